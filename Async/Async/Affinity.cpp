@@ -0,0 +1,130 @@
+#include "Async/Affinity.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <thread>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+ASYNC_BEGIN
+
+namespace
+{
+    bool readFirstLine(const std::string& path, std::string& line)
+    {
+        std::ifstream file(path);
+        return file && std::getline(file, line);
+    }
+    
+    CpuSet intersect(const CpuSet& a, const CpuSet& b)
+    {
+        CpuSet result;
+        std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(result));
+        return result;
+    }
+}
+
+namespace Details
+{
+    CpuSet parseCpuList(const std::string& list)
+    {
+        CpuSet cpus;
+        std::stringstream ss(list);
+        std::string range;
+        while (std::getline(ss, range, ','))
+        {
+            char* end = nullptr;
+            unsigned long first = std::strtoul(range.c_str(), &end, 10);
+            if (end == range.c_str())
+                continue;
+            
+            unsigned long last = (*end == '-') ? std::strtoul(end + 1, nullptr, 10) : first;
+            for (unsigned long cpu=first; cpu<=last; cpu++)
+                cpus.push_back(static_cast<uint32_t>(cpu));
+        }
+        
+        std::sort(cpus.begin(), cpus.end());
+        cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+        return cpus;
+    }
+}
+
+CpuSet getAvailableCpus()
+{
+    CpuSet cpus;
+
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for (uint32_t cpu=0; cpu<CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+        }
+    }
+#endif
+    
+    if (cpus.empty())
+    {
+        uint32_t numCpus = std::max(1u, std::thread::hardware_concurrency());
+        for (uint32_t cpu=0; cpu<numCpus; cpu++)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+uint32_t getNumNumaNodes()
+{
+#if defined(__linux__)
+    std::string online;
+    if (readFirstLine("/sys/devices/system/node/online", online))
+    {
+        CpuSet nodes = Details::parseCpuList(online);
+        if (!nodes.empty())
+            return nodes.back() + 1;
+    }
+#endif
+    return 1;
+}
+
+CpuSet getNumaNodeCpus(uint32_t node)
+{
+    CpuSet available = getAvailableCpus();
+
+#if defined(__linux__)
+    std::string list;
+    if (readFirstLine("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist", list))
+        return intersect(Details::parseCpuList(list), available);
+#endif
+    
+    return (node == 0) ? available : CpuSet();
+}
+
+bool pinCurrentThread(const CpuSet& cpus)
+{
+    if (cpus.empty())
+        return false;
+
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (uint32_t cpu : cpus)
+    {
+        if (cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+ASYNC_END
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "Async/Base.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+ASYNC_BEGIN
+
+// CPU topology and thread pinning. Topology comes from sysfs on Linux; elsewhere
+// every cpu is reported as part of a single NUMA node and pinning is a no-op
+// (macOS has no hard affinity API).
+typedef std::vector<uint32_t> CpuSet;
+
+// cpus this process may run on
+CpuSet getAvailableCpus();
+
+// always at least 1
+uint32_t getNumNumaNodes();
+
+// cpus of the given node that this process may run on
+CpuSet getNumaNodeCpus(uint32_t node);
+
+// restricts the calling thread to cpus, returns false if unsupported or rejected
+bool pinCurrentThread(const CpuSet& cpus);
+
+namespace Details
+{
+    // parses the sysfs cpulist format, e.g. "0-3,8,10-11"
+    CpuSet parseCpuList(const std::string& list);
+}
+
+ASYNC_END
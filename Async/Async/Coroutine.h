@@ -0,0 +1,190 @@
+#pragma once
+
+#include "Async/Task.h"
+
+#include <exception>
+#include <memory>
+#include <utility>
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define ASYNC_COROUTINES 1
+#endif
+#endif
+
+// C++20 coroutine support, compiled only where the compiler implements coroutines.
+//
+// A function returning Task<T> may be a coroutine. It starts running on the calling
+// thread and its task completes, without being queued anywhere, when it co_returns;
+// an escaping exception is stored in the task and rethrown by get(). Its task has no
+// queue of its own, so continuations added with then() must name one.
+//
+// co_await on a Task<T> suspends until the task completes and resumes the coroutine
+// directly on the thread that completed it. co_await resumeOn(queue) moves the rest
+// of the coroutine onto a queue, e.g. to get off a latency-sensitive worker or back
+// onto a RunLoopQueue. A coroutine awaiting a task that gets canceled, or whose
+// resume job is dropped (queue cleared or shut down), is never resumed.
+#ifdef ASYNC_COROUTINES
+
+ASYNC_BEGIN
+
+namespace Details
+{
+    template <typename T>
+    class CoroutinePromiseBase
+    {
+    public:
+        CoroutinePromiseBase()
+            : m_work(std::make_shared<typename Task<T>::Work>(QueueRef(), 0))
+        {
+        }
+        
+        Task<T> get_return_object()
+        {
+            return Task<T>(m_work);
+        }
+        
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+        
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+        
+        void unhandled_exception()
+        {
+            std::exception_ptr exception = std::current_exception();
+            m_work->complete([&exception](std::promise<T>& promise) {
+                promise.set_exception(exception);
+            });
+        }
+        
+    protected:
+        typename Task<T>::Work::Ptr m_work;
+    };
+    
+    template <typename T>
+    class CoroutinePromise
+        : public CoroutinePromiseBase<T>
+    {
+    public:
+        void return_value(T value)
+        {
+            this->m_work->complete([&value](std::promise<T>& promise) {
+                promise.set_value(std::move(value));
+            });
+        }
+    };
+    
+    template <>
+    class CoroutinePromise<void>
+        : public CoroutinePromiseBase<void>
+    {
+    public:
+        void return_void()
+        {
+            m_work->complete([](std::promise<void>& promise) {
+                promise.set_value();
+            });
+        }
+    };
+    
+    template <typename T>
+    class TaskAwaiter
+    {
+    public:
+        explicit TaskAwaiter(Task<T> task)
+            : m_task(std::move(task))
+        {
+        }
+        
+        bool await_ready() const
+        {
+            return m_task.getFuture().wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }
+        
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            // the handler runs right away if the task completed after await_ready(),
+            // whichever side flips m_suspended second owns resuming the coroutine
+            m_task.addCompletionHandler([this, handle](Task<T>) {
+                if (m_suspended.exchange(true))
+                    handle.resume();
+            });
+            return !m_suspended.exchange(true);
+        }
+        
+        T await_resume() const
+        {
+            return m_task.get();
+        }
+        
+    private:
+        Task<T> m_task;
+        std::atomic<bool> m_suspended{false};
+    };
+    
+    class ResumeOnAwaiter
+    {
+    public:
+        ResumeOnAwaiter(QueueRef queue, uint32_t priority)
+            : m_queue(queue)
+            , m_priority(priority)
+        {
+        }
+        
+        bool await_ready() const
+        {
+            return false;
+        }
+        
+        // keeps running on the current thread if the queue rejects the job. a job id
+        // of 0 can also mean a full RunOnCaller queue has already run it, and then
+        // the coroutine was resumed (and may be gone) before enqueue() returned
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            std::shared_ptr<bool> ran = std::make_shared<bool>(false);
+            uint64_t jobId = m_queue.enqueue([handle, ran]() {
+                *ran = true;
+                handle.resume();
+            }, m_priority);
+            return jobId != 0 || *ran;
+        }
+        
+        void await_resume() const
+        {
+        }
+        
+    private:
+        QueueRef m_queue;
+        uint32_t m_priority = 0;
+    };
+}
+
+template <typename T>
+Details::TaskAwaiter<T> operator co_await(Task<T> task)
+{
+    return Details::TaskAwaiter<T>(std::move(task));
+}
+
+inline Details::ResumeOnAwaiter resumeOn(QueueRef queue, uint32_t priority = 0)
+{
+    return Details::ResumeOnAwaiter(queue, priority);
+}
+
+ASYNC_END
+
+namespace std
+{
+    template <typename T, typename... Args>
+    struct coroutine_traits<Async::Task<T>, Args...>
+    {
+        typedef Async::Details::CoroutinePromise<T> promise_type;
+    };
+}
+
+#endif
@@ -0,0 +1,404 @@
+#include "Async/FileIO.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define ASYNC_IO_URING 1
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+
+ASYNC_BEGIN
+
+struct FileIO::Request
+{
+    bool write = false;
+    int fd = -1;
+    uint64_t offset = 0;
+    void* buffer = nullptr;
+    size_t size = 0;
+    Completion done;
+#ifdef ASYNC_IO_URING
+    iovec iov;
+#endif
+};
+
+namespace
+{
+    // the most Linux transfers in one call, larger requests complete short
+    const size_t MaxTransfer = 0x7ffff000;
+    
+    size_t errorResult(int error)
+    {
+        return static_cast<size_t>(0) - static_cast<size_t>(error);
+    }
+}
+
+#ifdef ASYNC_IO_URING
+
+////////// FileIO::Ring
+
+class FileIO::Ring
+{
+public:
+    // returns nullptr if the kernel does not allow io_uring
+    static std::unique_ptr<Ring> create(uint32_t queueDepth)
+    {
+        std::unique_ptr<Ring> ring(new Ring);
+        if (!ring->open(queueDepth))
+            return nullptr;
+        
+        ring->m_thread = std::thread(&Ring::run, ring.get());
+        return ring;
+    }
+    
+    ~Ring()
+    {
+        // requests already queued still complete
+        if (m_thread.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_running = false;
+            }
+            wake();
+            m_thread.join();
+        }
+        
+        if (m_sqes)
+            munmap(m_sqes, m_sqesSize);
+        if (m_cqRing && m_cqRing != m_sqRing)
+            munmap(m_cqRing, m_cqRingSize);
+        if (m_sqRing)
+            munmap(m_sqRing, m_sqRingSize);
+        if (m_wakeFd >= 0)
+            close(m_wakeFd);
+        if (m_ringFd >= 0)
+            close(m_ringFd);
+    }
+    
+    void submit(Request* request)
+    {
+        bool sleeping = false;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pending.push_back(request);
+            sleeping = m_sleeping;
+            m_sleeping = false;
+        }
+        
+        // one wake-up per round, later submitters find the flag cleared
+        if (sleeping)
+            wake();
+    }
+    
+private:
+    Ring()
+    {
+    }
+    
+    bool open(uint32_t queueDepth)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        m_ringFd = static_cast<int>(syscall(__NR_io_uring_setup, std::max(1u, queueDepth), &params));
+        if (m_ringFd < 0)
+            return false;
+        
+        m_sqEntries = params.sq_entries;
+        m_cqEntries = params.cq_entries;
+        m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        
+        // newer kernels map both rings with one call
+        bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (singleMap)
+            m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+        
+        m_sqRing = map(m_sqRingSize, IORING_OFF_SQ_RING);
+        m_cqRing = singleMap ? m_sqRing : map(m_cqRingSize, IORING_OFF_CQ_RING);
+        m_sqes = static_cast<io_uring_sqe*>(map(m_sqesSize, IORING_OFF_SQES));
+        m_wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (!m_sqRing || !m_cqRing || !m_sqes || m_wakeFd < 0)
+            return false;
+        
+        char* sq = static_cast<char*>(m_sqRing);
+        m_sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        m_sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        m_sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        m_sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        
+        char* cq = static_cast<char*>(m_cqRing);
+        m_cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        m_cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        m_cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+    
+    void* map(size_t size, off_t offset)
+    {
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, offset);
+        return (p == MAP_FAILED) ? nullptr : p;
+    }
+    
+    void wake()
+    {
+        uint64_t value = 1;
+        ssize_t result = ::write(m_wakeFd, &value, sizeof(value));
+        static_cast<void>(result);
+    }
+    
+    void run()
+    {
+        std::vector<std::pair<Request*, size_t>> completed;
+        for (;;)
+        {
+            // move queued requests into the submission ring. a poll on the wake
+            // eventfd is always in flight, so the wait below also ends when new
+            // requests arrive while we are parked in the kernel
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (!m_wakeArmed && m_inFlight < m_cqEntries)
+                {
+                    io_uring_sqe* sqe = nextSqe();
+                    sqe->opcode = IORING_OP_POLL_ADD;
+                    sqe->fd = m_wakeFd;
+                    sqe->poll_events = POLLIN;
+                    m_wakeArmed = true;
+                    m_inFlight++;
+                }
+                
+                while (!m_pending.empty() && m_inFlight < m_cqEntries && m_sqTailLocal - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) < m_sqEntries)
+                {
+                    prepare(nextSqe(), m_pending.front());
+                    m_pending.pop_front();
+                    m_inFlight++;
+                }
+                
+                if (!m_running && m_pending.empty() && m_inFlight == (m_wakeArmed ? 1u : 0u))
+                    break;
+                
+                m_sleeping = true;
+            }
+            
+            // submit the whole batch and wait for completions in one call
+            __atomic_store_n(m_sqTail, m_sqTailLocal, __ATOMIC_RELEASE);
+            unsigned toSubmit = m_sqTailLocal - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+            syscall(__NR_io_uring_enter, m_ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_sleeping = false;
+            }
+            
+            unsigned head = *m_cqHead;
+            unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+            for (; head != tail; head++)
+            {
+                const io_uring_cqe& cqe = m_cqes[head & m_cqMask];
+                m_inFlight--;
+                if (cqe.user_data == 0)
+                {
+                    uint64_t value = 0;
+                    ssize_t result = ::read(m_wakeFd, &value, sizeof(value));
+                    static_cast<void>(result);
+                    m_wakeArmed = false;
+                    continue;
+                }
+                
+                Request* request = reinterpret_cast<Request*>(static_cast<uintptr_t>(cqe.user_data));
+                size_t result = (cqe.res < 0) ? errorResult(-cqe.res) : static_cast<size_t>(cqe.res);
+                completed.push_back(std::make_pair(request, result));
+            }
+            __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+            
+            for (auto& it : completed)
+            {
+                it.first->done(it.second);
+                delete it.first;
+            }
+            completed.clear();
+        }
+    }
+    
+    io_uring_sqe* nextSqe()
+    {
+        unsigned index = m_sqTailLocal & m_sqMask;
+        io_uring_sqe* sqe = &m_sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        m_sqArray[index] = index;
+        m_sqTailLocal++;
+        return sqe;
+    }
+    
+    void prepare(io_uring_sqe* sqe, Request* request)
+    {
+        request->iov.iov_base = request->buffer;
+        request->iov.iov_len = std::min(request->size, MaxTransfer);
+        sqe->opcode = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = request->fd;
+        sqe->off = request->offset;
+        sqe->addr = reinterpret_cast<uintptr_t>(&request->iov);
+        sqe->len = 1;
+        sqe->user_data = reinterpret_cast<uintptr_t>(request);
+    }
+    
+    int m_ringFd = -1;
+    int m_wakeFd = -1;
+    void* m_sqRing = nullptr;
+    void* m_cqRing = nullptr;
+    io_uring_sqe* m_sqes = nullptr;
+    size_t m_sqRingSize = 0;
+    size_t m_cqRingSize = 0;
+    size_t m_sqesSize = 0;
+    
+    // shared with the kernel
+    unsigned* m_sqHead = nullptr;
+    unsigned* m_sqTail = nullptr;
+    unsigned* m_sqArray = nullptr;
+    unsigned* m_cqHead = nullptr;
+    unsigned* m_cqTail = nullptr;
+    io_uring_cqe* m_cqes = nullptr;
+    unsigned m_sqMask = 0;
+    unsigned m_cqMask = 0;
+    unsigned m_sqEntries = 0;
+    unsigned m_cqEntries = 0;
+    
+    // I/O thread only. the completion ring is never allowed to overflow
+    unsigned m_sqTailLocal = 0;
+    unsigned m_inFlight = 0;
+    bool m_wakeArmed = false;
+    
+    std::mutex m_mutex;
+    std::deque<Request*> m_pending;
+    bool m_sleeping = false;
+    bool m_running = true;
+    std::thread m_thread;
+};
+
+#else
+
+class FileIO::Ring
+{
+public:
+    static std::unique_ptr<Ring> create(uint32_t)
+    {
+        return nullptr;
+    }
+    
+    void submit(Request*)
+    {
+    }
+};
+
+#endif
+
+////////// FileIO
+
+FileIO::FileIO()
+    : FileIO(Options())
+{
+}
+
+FileIO::FileIO(const Options& options)
+{
+    if (options.backend != Backend::Threads)
+        m_ring = Ring::create(options.queueDepth);
+    
+    if (!m_ring)
+        m_pool.reset(new ThreadPoolQueue(std::max(1u, options.numThreads)));
+}
+
+FileIO::~FileIO()
+{
+    // both backends finish the requests they were given first
+    m_ring.reset();
+    if (m_pool)
+        m_pool->drain(std::chrono::steady_clock::time_point::max());
+}
+
+FileIO&
+FileIO::getDefault()
+{
+    static FileIO fileIO;
+    return fileIO;
+}
+
+FileIO::Backend
+FileIO::getBackend() const
+{
+    return m_ring ? Backend::IoUring : Backend::Threads;
+}
+
+void
+FileIO::read(int fd, uint64_t offset, void* buffer, size_t size, Completion&& done)
+{
+    Request* request = new Request;
+    request->fd = fd;
+    request->offset = offset;
+    request->buffer = buffer;
+    request->size = size;
+    request->done = std::move(done);
+    submit(request);
+}
+
+void
+FileIO::write(int fd, uint64_t offset, const void* buffer, size_t size, Completion&& done)
+{
+    Request* request = new Request;
+    request->write = true;
+    request->fd = fd;
+    request->offset = offset;
+    request->buffer = const_cast<void*>(buffer);
+    request->size = size;
+    request->done = std::move(done);
+    submit(request);
+}
+
+void
+FileIO::submit(Request* request)
+{
+    if (m_ring)
+    {
+        m_ring->submit(request);
+        return;
+    }
+    
+    m_pool->enqueue([this, request]() {
+        runBlocking(request);
+    });
+}
+
+void
+FileIO::runBlocking(Request* request)
+{
+    size_t size = std::min(request->size, MaxTransfer);
+    off_t offset = static_cast<off_t>(request->offset);
+    ssize_t n = 0;
+    do
+    {
+        n = request->write ? pwrite(request->fd, request->buffer, size, offset) : pread(request->fd, request->buffer, size, offset);
+    }
+    while (n < 0 && errno == EINTR);
+    
+    request->done((n < 0) ? errorResult(errno) : static_cast<size_t>(n));
+    delete request;
+}
+
+ASYNC_END
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "Async/Task.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+ASYNC_BEGIN
+
+// Positional file reads and writes that do not occupy a thread while in flight. On
+// Linux requests are batched through an io_uring: one I/O thread moves queued requests
+// into the submission ring, submits them and reaps completions with a single
+// io_uring_enter() per round, so many reads can be outstanding at once. Where io_uring
+// is unavailable the requests run as blocking pread()/pwrite() calls on a small
+// private thread pool instead.
+//
+// Results are byte counts, possibly short like pread(). Failures are reported as
+// results for which isIOError() is true, see ioErrorCode() for the errno value.
+// Buffers must stay valid until the request has completed.
+class FileIO
+{
+public:
+    typedef std::function<void(size_t)> Completion;
+    
+    enum class Backend
+    {
+        Auto,    // io_uring if the kernel allows it, else Threads
+        IoUring,
+        Threads,
+    };
+    
+    struct Options
+    {
+        Backend backend = Backend::Auto;
+        
+        // io_uring submission ring size. more requests than this wait in a queue
+        uint32_t queueDepth = 256;
+        
+        // workers for the Threads backend
+        uint32_t numThreads = 4;
+    };
+    
+    FileIO();
+    FileIO(const Options& options);
+    ~FileIO();
+    
+    FileIO(const FileIO&) = delete;
+    FileIO& operator=(const FileIO&) = delete;
+    
+    // the instance behind readFile() and writeFile(), started on first use
+    static FileIO& getDefault();
+    
+    // the backend in use, never Auto. asking for IoUring where it is unavailable
+    // falls back to Threads
+    Backend getBackend() const;
+    
+    // done is called with the result on the I/O thread (or a pool worker), so it
+    // should only hand the result off
+    void read(int fd, uint64_t offset, void* buffer, size_t size, Completion&& done);
+    void write(int fd, uint64_t offset, const void* buffer, size_t size, Completion&& done);
+    
+private:
+    struct Request;
+    class Ring;
+    
+    void submit(Request* request);
+    void runBlocking(Request* request);
+    
+    std::unique_ptr<Ring> m_ring;
+    std::unique_ptr<ThreadPoolQueue> m_pool;
+};
+
+inline bool isIOError(size_t result)
+{
+    return result > static_cast<size_t>(-4096);
+}
+
+inline int ioErrorCode(size_t result)
+{
+    return isIOError(result) ? static_cast<int>(0 - result) : 0;
+}
+
+// return tasks that complete on queue with the result of the read (or write), the
+// usual then() continuations run once it is available
+inline Task<size_t> readFile(QueueRef queue, int fd, uint64_t offset, void* buffer, size_t size, uint32_t priority = 0)
+{
+    std::shared_ptr<size_t> result = std::make_shared<size_t>(0);
+    return Task<size_t>::whenSignaled(queue, [result]() { return *result; }, priority, [&](const std::function<void()>& signal) {
+        FileIO::getDefault().read(fd, offset, buffer, size, [result, signal](size_t n) {
+            *result = n;
+            signal();
+        });
+    });
+}
+
+inline Task<size_t> writeFile(QueueRef queue, int fd, uint64_t offset, const void* buffer, size_t size, uint32_t priority = 0)
+{
+    std::shared_ptr<size_t> result = std::make_shared<size_t>(0);
+    return Task<size_t>::whenSignaled(queue, [result]() { return *result; }, priority, [&](const std::function<void()>& signal) {
+        FileIO::getDefault().write(fd, offset, buffer, size, [result, signal](size_t n) {
+            *result = n;
+            signal();
+        });
+    });
+}
+
+ASYNC_END
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "Async/Base.h"
+
+#include <cstdint>
+
+ASYNC_BEGIN
+
+// Compile-time instrumentation hooks. When the library (and every file that
+// includes Task.h) is built with ASYNC_OBSERVER defined, the functions of
+// Observer are called at the points described below and the application has
+// to define them, the linker binds the calls. Without ASYNC_OBSERVER the hooks
+// expand to nothing, so they cost nothing.
+//
+// Hooks run on the thread doing the work and inside the library's hot paths,
+// some with queue locks held: they must be cheap and must not call back into
+// the queue they observe.
+struct Observer
+{
+    enum class TaskEvent
+    {
+        Scheduled,
+        Started,
+        Completed,
+        Canceled
+    };
+    
+    static void onEnqueue(uint64_t jobId); // the job is in its queue
+    static void onDequeue(uint64_t jobId); // taken out of the queue to run
+    static void onStart(uint64_t jobId);
+    static void onFinish(uint64_t jobId);
+    static void onCancel(uint64_t jobId);  // canceled, or dropped without running
+    
+    static void onTaskTransition(const void* task, TaskEvent event);
+};
+
+#ifdef ASYNC_OBSERVER
+#define ASYNC_HOOK(call) Async::Observer::call
+#else
+#define ASYNC_HOOK(call) static_cast<void>(0)
+#endif
+
+ASYNC_END
@@ -0,0 +1,219 @@
+#pragma once
+
+#include "Async/Base.h"
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+ASYNC_BEGIN
+
+// Move-only, type-erased void() callable used to store queued jobs.
+// Callables up to InlineSize bytes that are nothrow-movable are stored in place,
+// so the usual small closure travels from enqueue to execution without touching
+// the heap. Larger callables fall back to a single heap allocation.
+class JobFunc
+{
+public:
+    static const size_t InlineSize = 96;
+    
+    JobFunc()
+    {
+    }
+    
+    JobFunc(std::nullptr_t)
+    {
+    }
+    
+    template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, JobFunc>::value>::type>
+    JobFunc(F&& f)
+    {
+        typedef typename std::decay<F>::type Func;
+        
+        // an empty std::function or null function pointer makes an empty JobFunc,
+        // so enqueue rejects it instead of a worker calling it
+        if (isNull(f))
+            return;
+        init<Func>(std::forward<F>(f), std::integral_constant<bool, fitsInline<Func>()>());
+    }
+    
+    JobFunc(JobFunc&& other) noexcept
+    {
+        moveFrom(other);
+    }
+    
+    JobFunc& operator=(JobFunc&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            moveFrom(other);
+        }
+        return *this;
+    }
+    
+    JobFunc(const JobFunc&) = delete;
+    JobFunc& operator=(const JobFunc&) = delete;
+    
+    ~JobFunc()
+    {
+        reset();
+    }
+    
+    explicit operator bool() const
+    {
+        return m_ops != nullptr;
+    }
+    
+    bool isInline() const
+    {
+        return m_ops && m_ops->isInline;
+    }
+    
+    void operator()()
+    {
+        m_ops->invoke(&m_storage);
+    }
+    
+    void reset()
+    {
+        if (m_ops)
+        {
+            m_ops->destroy(&m_storage);
+            m_ops = nullptr;
+        }
+    }
+    
+private:
+    typedef typename std::aligned_storage<InlineSize, alignof(std::max_align_t)>::type Storage;
+    
+    struct Ops
+    {
+        void (*invoke)(void* storage);
+        void (*move)(void* to, void* from);
+        void (*destroy)(void* storage);
+        bool isInline;
+    };
+    
+    template <typename Func>
+    static constexpr bool fitsInline()
+    {
+        return sizeof(Func) <= sizeof(Storage)
+            && alignof(Storage) % alignof(Func) == 0
+            && std::is_nothrow_move_constructible<Func>::value;
+    }
+    
+    template <typename Func>
+    static bool isNull(Func* f)
+    {
+        return f == nullptr;
+    }
+    
+    template <typename Signature>
+    static bool isNull(const std::function<Signature>& f)
+    {
+        return !f;
+    }
+    
+    template <typename Func>
+    static bool isNull(const Func&)
+    {
+        return false;
+    }
+    
+    template <typename Func>
+    struct InlineOps
+    {
+        static void invoke(void* storage)
+        {
+            (*static_cast<Func*>(storage))();
+        }
+        
+        static void move(void* to, void* from)
+        {
+            Func* f = static_cast<Func*>(from);
+            new (to) Func(std::move(*f));
+            f->~Func();
+        }
+        
+        static void destroy(void* storage)
+        {
+            static_cast<Func*>(storage)->~Func();
+        }
+        
+        static const Ops ops;
+    };
+    
+    template <typename Func>
+    struct HeapOps
+    {
+        static Func*& ptr(void* storage)
+        {
+            return *static_cast<Func**>(storage);
+        }
+        
+        static void invoke(void* storage)
+        {
+            (*ptr(storage))();
+        }
+        
+        static void move(void* to, void* from)
+        {
+            new (to) Func*(ptr(from));
+        }
+        
+        static void destroy(void* storage)
+        {
+            delete ptr(storage);
+        }
+        
+        static const Ops ops;
+    };
+    
+    template <typename Func, typename F>
+    void init(F&& f, std::true_type)
+    {
+        new (&m_storage) Func(std::forward<F>(f));
+        m_ops = &InlineOps<Func>::ops;
+    }
+    
+    template <typename Func, typename F>
+    void init(F&& f, std::false_type)
+    {
+        new (&m_storage) Func*(new Func(std::forward<F>(f)));
+        m_ops = &HeapOps<Func>::ops;
+    }
+    
+    void moveFrom(JobFunc& other)
+    {
+        if (other.m_ops)
+        {
+            other.m_ops->move(&m_storage, &other.m_storage);
+            m_ops = other.m_ops;
+            other.m_ops = nullptr;
+        }
+    }
+    
+    Storage m_storage;
+    const Ops* m_ops = nullptr;
+};
+
+template <typename Func>
+const JobFunc::Ops JobFunc::InlineOps<Func>::ops = {
+    &JobFunc::InlineOps<Func>::invoke,
+    &JobFunc::InlineOps<Func>::move,
+    &JobFunc::InlineOps<Func>::destroy,
+    true
+};
+
+template <typename Func>
+const JobFunc::Ops JobFunc::HeapOps<Func>::ops = {
+    &JobFunc::HeapOps<Func>::invoke,
+    &JobFunc::HeapOps<Func>::move,
+    &JobFunc::HeapOps<Func>::destroy,
+    false
+};
+
+ASYNC_END
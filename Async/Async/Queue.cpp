@@ -1,7 +1,11 @@
 #include "Async/Queue.h"
+#include "Async/Hooks.h"
+#include "Async/Timer.h"
+#include "Async/Trace.h"
 
+#include <algorithm>
 #include <cassert>
-#include <map>
+#include <unordered_map>
 
 ASYNC_BEGIN
 
@@ -10,238 +14,2188 @@ namespace
     std::mutex s_queueIdMutex;
     uint32_t s_nextQueueId;
     
-    typedef std::map<uint32_t, Queue::Ptr> QueueMap;
-    std::mutex s_queuesMutex;
-    QueueMap s_queues;
+    // Registered queues live in an immutable open-addressing table. Writers copy it
+    // under s_registryMutex and publish the copy with an atomic pointer swap, readers
+    // look up queues without locking and without writing any shared cache line.
+    //
+    // Old tables are reclaimed with epochs: a reader announces the global epoch in
+    // its own (padded) slot while it uses a table, and a table retired at epoch e is
+    // freed once no announced epoch is older than e.
+    struct QueueTable
+    {
+        struct Entry
+        {
+            uint32_t queueId = 0;
+            Queue::Ptr queue;
+        };
+        
+        explicit QueueTable(size_t minCapacity)
+        {
+            size_t capacity = 8;
+            while (capacity < minCapacity * 2)
+                capacity <<= 1;
+            
+            mask = capacity - 1;
+            entries.reset(new Entry[capacity]);
+        }
+        
+        static size_t hash(uint32_t queueId)
+        {
+            return queueId * 2654435761u;
+        }
+        
+        Queue* find(uint32_t queueId) const
+        {
+            for (size_t i=hash(queueId); ; i++)
+            {
+                const Entry& entry = entries[i & mask];
+                if (!entry.queue)
+                    return nullptr;
+                if (entry.queueId == queueId)
+                    return entry.queue.get();
+            }
+        }
+        
+        void insert(uint32_t queueId, const Queue::Ptr& queue)
+        {
+            for (size_t i=hash(queueId); ; i++)
+            {
+                Entry& entry = entries[i & mask];
+                if (!entry.queue)
+                {
+                    entry.queueId = queueId;
+                    entry.queue = queue;
+                    size++;
+                    return;
+                }
+            }
+        }
+        
+        size_t mask = 0;
+        size_t size = 0;
+        std::unique_ptr<Entry[]> entries;
+        uint64_t retireEpoch = 0;
+    };
+    
+    struct ReaderSlot
+    {
+        std::atomic<uint64_t> epoch{0}; // 0 while not reading
+        std::atomic<bool> inUse{false};
+        uint32_t depth = 0;             // owning thread only, reads may nest
+        ReaderSlot* next = nullptr;
+        char padding[64];
+    };
+    
+    std::atomic<QueueTable*> s_table{nullptr};
+    std::atomic<uint64_t> s_epoch{1};
+    std::atomic<ReaderSlot*> s_readers{nullptr}; // push-only list, slots are never freed
+    std::atomic<bool> s_retiredPending{false};
+    std::mutex s_registryMutex;
+    std::vector<QueueTable*> s_retired;
+    
+    ReaderSlot* acquireReaderSlot()
+    {
+        for (ReaderSlot* slot = s_readers.load(); slot; slot = slot->next)
+        {
+            bool expected = false;
+            if (!slot->inUse.load(std::memory_order_relaxed) && slot->inUse.compare_exchange_strong(expected, true))
+                return slot;
+        }
+        
+        ReaderSlot* slot = new ReaderSlot;
+        slot->inUse = true;
+        slot->next = s_readers.load();
+        while (!s_readers.compare_exchange_weak(slot->next, slot)) {}
+        return slot;
+    }
+    
+    // hands the thread's slot back for reuse when the thread exits
+    struct ThreadReader
+    {
+        ~ThreadReader()
+        {
+            if (slot)
+                slot->inUse.store(false, std::memory_order_release);
+        }
+        
+        ReaderSlot* slot = nullptr;
+    };
+    
+    thread_local ThreadReader s_threadReader;
+    
+    // returns the retired tables no reader can still see. they must be deleted after
+    // releasing s_registryMutex, dropping a queue can run arbitrary destructors
+    std::vector<QueueTable*> takeReclaimableUnprotected()
+    {
+        uint64_t oldest = UINT64_MAX;
+        for (ReaderSlot* slot = s_readers.load(); slot; slot = slot->next)
+        {
+            uint64_t epoch = slot->epoch.load();
+            if (epoch != 0)
+                oldest = std::min(oldest, epoch);
+        }
+        
+        std::vector<QueueTable*> reclaimable;
+        auto it = std::partition(s_retired.begin(), s_retired.end(), [oldest](QueueTable* table) {
+            return table->retireEpoch > oldest;
+        });
+        reclaimable.assign(it, s_retired.end());
+        s_retired.erase(it, s_retired.end());
+        s_retiredPending = !s_retired.empty();
+        return reclaimable;
+    }
+    
+    void tryReclaimRetired()
+    {
+        std::vector<QueueTable*> reclaimable;
+        {
+            std::unique_lock<std::mutex> lock(s_registryMutex, std::try_to_lock);
+            if (lock)
+                reclaimable = takeReclaimableUnprotected();
+        }
+        
+        for (QueueTable* table : reclaimable)
+            delete table;
+    }
+    
+    // publishes table and retires the previous one, s_registryMutex must be held
+    std::vector<QueueTable*> publishUnprotected(QueueTable* table)
+    {
+        QueueTable* old = s_table.exchange(table);
+        if (old)
+        {
+            old->retireEpoch = s_epoch.fetch_add(1) + 1;
+            s_retired.push_back(old);
+        }
+        return takeReclaimableUnprotected();
+    }
+    
+    // keeps the current table (and so every registered queue) alive while in scope
+    class ReadGuard
+    {
+    public:
+        ReadGuard()
+        {
+            ReaderSlot*& slot = s_threadReader.slot;
+            if (!slot)
+                slot = acquireReaderSlot();
+            
+            m_slot = slot;
+            if (m_slot->depth++ == 0)
+                m_slot->epoch.store(s_epoch.load());
+            m_table = s_table.load();
+        }
+        
+        ~ReadGuard()
+        {
+            if (--m_slot->depth == 0)
+            {
+                m_slot->epoch.store(0, std::memory_order_release);
+                if (s_retiredPending.load(std::memory_order_relaxed))
+                    tryReclaimRetired();
+            }
+        }
+        
+        Queue* find(uint32_t queueId) const
+        {
+            return m_table ? m_table->find(queueId) : nullptr;
+        }
+        
+    private:
+        ReaderSlot* m_slot;
+        QueueTable* m_table;
+    };
+    
+    struct RegistryCleanup
+    {
+        ~RegistryCleanup()
+        {
+            std::vector<QueueTable*> tables;
+            {
+                std::lock_guard<std::mutex> lock(s_registryMutex);
+                tables.swap(s_retired);
+                tables.push_back(s_table.exchange(nullptr));
+            }
+            
+            for (QueueTable* table : tables)
+                delete table;
+        }
+    };
+    
+    RegistryCleanup s_registryCleanup;
+    
+    // each thread remembers its counter block per queue. the blocks belong to their
+    // queues, a raw pointer found under a queue's (never reused) stats id is valid
+    // because that queue is the one asking. entries of destroyed queues are swept
+    // whenever the cache has doubled in size, the others are handed back for reuse
+    // when the thread exits
+    struct ThreadStatsCache
+    {
+        struct Entry
+        {
+            void* stats = nullptr;
+            std::atomic<bool>* inUse = nullptr;
+            std::weak_ptr<void> owner;
+        };
+        
+        ~ThreadStatsCache()
+        {
+            for (auto& e : entries)
+            {
+                // holding the owner keeps the block alive if its queue is going away
+                std::shared_ptr<void> owner = e.second.owner.lock();
+                if (owner)
+                    e.second.inUse->store(false, std::memory_order_release);
+            }
+        }
+        
+        uint64_t lastId = 0;
+        void* last = nullptr;
+        std::unordered_map<uint64_t, Entry> entries;
+        size_t sweepAt = 16;
+    };
+    
+    std::atomic<uint64_t> s_nextStatsId{1};
+    thread_local ThreadStatsCache s_threadStats;
+    
+    int64_t nowTicks()
+    {
+        return std::chrono::steady_clock::now().time_since_epoch().count();
+    }
+}
+
+//////////////////////////////////////////////////////
+//////////////////////////////////////////////////////
+////////// Queue
+//////////////////////////////////////////////////////
+//////////////////////////////////////////////////////
+
+Queue::Queue()
+{
+    {
+        std::lock_guard<std::mutex> lock(s_queueIdMutex);
+        m_queueId = s_nextQueueId;
+        s_nextQueueId++;
+    }
+    init(Options());
+}
+
+Queue::Queue(uint32_t queueId)
+    : m_queueId(queueId)
+{
+    init(Options());
+}
+
+Queue::Queue(uint32_t queueId, const Options& options)
+    : m_queueId(queueId)
+{
+    init(options);
+}
+
+Queue::~Queue()
+{
+}
+
+void
+Queue::init(const Options& options)
+{
+    if (options.storage == Storage::RingBuffer)
+    {
+        // the ring is a single FIFO, priorities need the deque storage
+        assert(options.numPriorities <= 1);
+        m_ring.reset(new JobRing(options.capacity));
+    }
+    
+    uint32_t numPriorities = std::max(1u, options.numPriorities);
+    if (numPriorities > MaxPriorities)
+        numPriorities = MaxPriorities;
+    if (m_ring)
+        numPriorities = 1;
+    
+    // bands are move-only, so construct them in place
+    std::vector<Band> bands(numPriorities);
+    m_bands.swap(bands);
+    m_agingLimit = options.agingLimit;
+    
+    // the ring is bounded by its capacity
+    m_maxJobs = m_ring ? 0 : options.maxJobs;
+    m_overflow = options.overflow;
+    
+    m_timeJobs = options.timeJobs;
+    m_statsId = s_nextStatsId.fetch_add(1, std::memory_order_relaxed);
+}
+
+Queue::ThreadStats::ThreadStats()
+{
+    // atomics aren't zeroed by default construction
+    inUse = true;
+    numEnqueued = 0;
+    numDequeued = 0;
+    numCanceled = 0;
+    numRejected = 0;
+    numDropped = 0;
+    for (size_t i=0; i<LatencyHistogram::NumBuckets; i++)
+    {
+        waitTime[i] = 0;
+        runTime[i] = 0;
+    }
+}
+
+uint32_t
+Queue::getId()
+{
+    return m_queueId;
+}
+
+Queue::Storage
+Queue::getStorage() const
+{
+    return m_ring ? Storage::RingBuffer : Storage::Deque;
+}
+
+uint32_t
+Queue::getNumPriorities() const
+{
+    return static_cast<uint32_t>(m_bands.size());
+}
+
+Queue::Overflow
+Queue::getOverflow() const
+{
+    return m_overflow;
+}
+
+size_t
+Queue::getMaxJobs() const
+{
+    return m_ring ? m_ring->capacity() : m_maxJobs;
+}
+
+uint32_t
+Queue::clampPriority(uint32_t priority) const
+{
+    return std::min(priority, getNumPriorities() - 1);
+}
+
+uint64_t
+Queue::makeJobId(uint32_t jobNumber) const
+{
+    uint64_t jobId = m_queueId;
+    jobId <<= 32;
+    jobId += jobNumber;
+    return jobId;
+}
+
+uint64_t
+Queue::enqueueJob(Job&& job, Overflow overflow)
+{
+    // an empty job would be taken for a canceled one later on
+    if (!job.func)
+    {
+        increment(threadStats().numRejected, 1);
+        return 0;
+    }
+    
+    if (m_timeJobs)
+        job.enqueueTime = nowTicks();
+    
+    // jobs dropped to make room are destroyed after unlocking, like canceled ones
+    Callbacks dropped;
+    
+    uint64_t jobId = 0;
+    if (enqueueLocal(job, jobId))
+    {
+        // a subclass took the job
+    }
+    else if (m_ring)
+    {
+        // the ring position doubles as the job number, which lets cancel() find the slot
+        uint64_t pos = 0;
+        while (!m_ring->tryPush(std::move(job), pos))
+        {
+            if (overflow == Overflow::Fail || overflow == Overflow::RunOnCaller)
+            {
+                increment(threadStats().numRejected, 1);
+                if (overflow == Overflow::RunOnCaller)
+                    job.func();
+                return 0;
+            }
+            
+            if (overflow != Overflow::DropOldest || !dropOldestFromRing())
+                std::this_thread::yield();
+        }
+        
+        jobId = makeJobId(ringJobNumber(pos));
+    }
+    else
+    {
+        std::unique_lock<std::mutex> lock(m_jobsMutex);
+        while (fullUnprotected(1))
+        {
+            switch (overflow)
+            {
+                case Overflow::Block:
+                    m_numBlocked++;
+                    m_spaceCond.wait(lock);
+                    m_numBlocked--;
+                    break;
+                
+                case Overflow::Fail:
+                    increment(threadStats().numRejected, 1);
+                    return 0;
+                
+                case Overflow::DropOldest:
+                    dropOldestUnprotected(dropped);
+                    break;
+                
+                case Overflow::RunOnCaller:
+                    lock.unlock();
+                    increment(threadStats().numRejected, 1);
+                    job.func();
+                    return 0;
+            }
+        }
+        
+        Band& band = m_bands[job.priority];
+        jobId = makeJobId(nextJobNumberUnprotected(band, job.priority, 1));
+        job.id = jobId;
+        band.jobs.push_back(std::move(job));
+        size_t depth = m_numQueued.fetch_add(1, std::memory_order_relaxed) + 1;
+        m_peakDepth = std::max(m_peakDepth, depth);
+    }
+    
+    increment(threadStats().numEnqueued, 1);
+    if (Details::isTracing())
+        Details::traceEnqueue(jobId);
+    ASYNC_HOOK(onEnqueue(jobId));
+    newJobAdded();
+    return jobId;
+}
+
+uint64_t
+Queue::enqueueJobs(std::vector<Job>& jobs)
+{
+    if (jobs.empty())
+        return 0;
+    
+    // one empty job rejects the batch, which is enqueued all or nothing
+    for (auto& job : jobs)
+    {
+        if (!job.func)
+        {
+            increment(threadStats().numRejected, jobs.size());
+            return 0;
+        }
+    }
+    
+    if (m_timeJobs)
+    {
+        int64_t now = nowTicks();
+        for (auto& job : jobs)
+            job.enqueueTime = now;
+    }
+    
+    // jobs dropped to make room are destroyed after unlocking, like canceled ones
+    Callbacks dropped;
+    
+    uint64_t firstJobId = 0;
+    if (m_ring)
+    {
+        // a reservation can't be refused in part, so the overflow policy is applied
+        // up front (against a size that may be stale). Block waits for each slot in turn
+        if (m_overflow != Overflow::Block && fullUnprotected(jobs.size()))
+        {
+            if (m_overflow == Overflow::Fail || m_overflow == Overflow::RunOnCaller)
+            {
+                increment(threadStats().numRejected, jobs.size());
+                if (m_overflow == Overflow::RunOnCaller)
+                {
+                    for (auto& job : jobs)
+                        job.func();
+                }
+                return 0;
+            }
+            
+            while (fullUnprotected(jobs.size()) && dropOldestFromRing())
+                ;
+        }
+        
+        uint64_t pos = m_ring->reserve(jobs.size());
+        firstJobId = makeJobId(ringJobNumber(pos));
+        for (auto& job : jobs)
+        {
+            while (!m_ring->tryPublish(pos, std::move(job)))
+                std::this_thread::yield();
+            pos++;
+        }
+    }
+    else
+    {
+        // all jobs of a bulk enqueue share one priority
+        uint32_t priority = jobs.front().priority;
+        
+        std::unique_lock<std::mutex> lock(m_jobsMutex);
+        while (fullUnprotected(jobs.size()))
+        {
+            switch (m_overflow)
+            {
+                case Overflow::Block:
+                    m_numBlocked++;
+                    m_numBlockedBulk++;
+                    m_spaceCond.wait(lock);
+                    m_numBlockedBulk--;
+                    m_numBlocked--;
+                    break;
+                
+                case Overflow::Fail:
+                    increment(threadStats().numRejected, jobs.size());
+                    return 0;
+                
+                case Overflow::DropOldest:
+                    dropOldestUnprotected(dropped);
+                    break;
+                
+                case Overflow::RunOnCaller:
+                    lock.unlock();
+                    increment(threadStats().numRejected, jobs.size());
+                    for (auto& job : jobs)
+                        job.func();
+                    return 0;
+            }
+        }
+        
+        Band& band = m_bands[priority];
+        firstJobId = makeJobId(nextJobNumberUnprotected(band, priority, static_cast<uint32_t>(jobs.size())));
+        
+        uint32_t offset = 0;
+        for (auto& job : jobs)
+        {
+            assert(job.priority == priority);
+            job.id = offsetJobId(firstJobId, offset++);
+            band.jobs.push_back(std::move(job));
+        }
+        size_t depth = m_numQueued.fetch_add(jobs.size(), std::memory_order_relaxed) + jobs.size();
+        m_peakDepth = std::max(m_peakDepth, depth);
+    }
+    
+    increment(threadStats().numEnqueued, jobs.size());
+    if (Details::isTracing())
+    {
+        for (uint32_t i=0; i<jobs.size(); i++)
+            Details::traceEnqueue(offsetJobId(firstJobId, i));
+    }
+#ifdef ASYNC_OBSERVER
+    for (uint32_t i=0; i<jobs.size(); i++)
+        ASYNC_HOOK(onEnqueue(offsetJobId(firstJobId, i)));
+#endif
+    newJobsAdded(jobs.size());
+    return firstJobId;
+}
+
+uint32_t
+Queue::nextJobNumberUnprotected(Band& band, uint32_t priority, uint32_t count)
+{
+    uint32_t counter = band.nextJobNumber;
+    band.nextJobNumber = advanceCounter(counter, count);
+    return (priority << JobCounterBits) | counter;
+}
+
+uint32_t
+Queue::advanceCounter(uint32_t counter, uint32_t offset)
+{
+    return static_cast<uint32_t>((static_cast<uint64_t>(counter) + JobCounterMask - 1 + offset) % JobCounterMask) + 1;
+}
+
+uint32_t
+Queue::ringJobNumber(uint64_t pos)
+{
+    return static_cast<uint32_t>(pos % JobCounterMask) + 1;
+}
+
+uint64_t
+Queue::offsetJobId(uint64_t jobId, uint32_t offset)
+{
+    // the counter wraps within its own bits, queue id and priority stay untouched
+    uint32_t counter = advanceCounter(static_cast<uint32_t>(jobId) & JobCounterMask, offset);
+    return (jobId & ~static_cast<uint64_t>(JobCounterMask)) | counter;
+}
+
+bool
+Queue::cancel(uint64_t jobId)
+{
+    uint32_t queueId = jobId >> 32;
+    if (queueId != m_queueId)
+        return false;
+    
+    uint32_t jobNumber = static_cast<uint32_t>(jobId);
+    uint32_t counter = jobNumber & JobCounterMask;
+    if ((jobNumber & LocalJobBit) || counter == 0)
+        return false;
+    
+    if (m_ring)
+    {
+        // recover the full 64-bit ring position from the job counter,
+        // a pending job is always less than one counter lap behind the tail
+        uint64_t tail = m_ring->tail();
+        if (tail == 0)
+            return false;
+        
+        uint64_t newest = tail - 1;
+        uint64_t behind = (newest % JobCounterMask + JobCounterMask - (counter - 1)) % JobCounterMask;
+        if (behind > newest)
+            return false;
+        
+        if (!m_ring->revoke(newest - behind))
+            return false;
+        
+        increment(threadStats().numCanceled, 1);
+        ASYNC_HOOK(onCancel(jobId));
+        return true;
+    }
+    
+    uint32_t priority = jobNumber >> JobCounterBits;
+    if (priority >= m_bands.size())
+        return false;
+    
+    // the callable is destroyed after unlocking, its destructor may enqueue or cancel
+    JobFunc canceled;
+    Callbacks callbacks;
+    {
+        std::lock_guard<std::mutex> lock(m_jobsMutex);
+        Band& band = m_bands[priority];
+        if (band.jobs.empty())
+            return false;
+        
+        // job numbers within a band are contiguous (assigned under this mutex and
+        // never erased from the middle), so the job's index is just an offset
+        uint32_t frontCounter = static_cast<uint32_t>(band.jobs.front().id) & JobCounterMask;
+        uint32_t offset = (counter + JobCounterMask - frontCounter) % JobCounterMask;
+        if (offset >= band.jobs.size())
+            return false;
+        
+        Job& job = band.jobs[offset];
+        assert(job.id == jobId);
+        if (!job.func)
+            return false;
+        
+        // leave a tombstone behind
+        canceled = std::move(job.func);
+        band.numCanceled++;
+        m_numQueued.fetch_sub(1, std::memory_order_relaxed);
+        popCanceledUnprotected(band);
+        spaceFreedUnprotected(1, callbacks);
+    }
+    
+    increment(threadStats().numCanceled, 1);
+    ASYNC_HOOK(onCancel(jobId));
+    for (auto& callback : callbacks)
+        callback();
+    return true;
+}
+
+void
+Queue::popCanceledUnprotected(Band& band)
+{
+    while (!band.jobs.empty() && !band.jobs.front().func)
+    {
+        band.jobs.pop_front();
+        band.numCanceled--;
+    }
+}
+
+bool
+Queue::popNextUnprotected(Job& job)
+{
+    // take the highest priority band, unless a lower one has aged past the limit
+    Band* top = nullptr;
+    Band* aged = nullptr;
+    for (auto& band : m_bands)
+    {
+        // tombstones never sit at the front, so a non-empty band has a live job
+        if (band.jobs.empty())
+            continue;
+        
+        if (!top)
+        {
+            top = &band;
+            continue;
+        }
+        
+        band.skipped++;
+        if (!aged && m_agingLimit > 0 && band.skipped >= m_agingLimit)
+            aged = &band;
+    }
+    
+    if (!top)
+        return false;
+    
+    Band& band = aged ? *aged : *top;
+    band.skipped = 0;
+    job = std::move(band.jobs.front());
+    band.jobs.pop_front();
+    m_numQueued.fetch_sub(1, std::memory_order_relaxed);
+    popCanceledUnprotected(band);
+    return true;
+}
+
+bool
+Queue::empty()
+{
+    std::lock_guard<std::mutex> lock(m_jobsMutex);
+    return emptyUnprotected();
+}
+
+bool
+Queue::emptyUnprotected()
+{
+    if (m_ring)
+        return m_ring->empty();
+    
+    for (const auto& band : m_bands)
+    {
+        if (band.jobs.size() != band.numCanceled)
+            return false;
+    }
+    return true;
+}
+
+bool
+Queue::emptyHint() const
+{
+    return sizeHint() == 0;
+}
+
+size_t
+Queue::sizeHint() const
+{
+    if (m_ring)
+        return m_ring->size();
+    
+    return m_numQueued.load(std::memory_order_relaxed);
+}
+
+bool
+Queue::runNext()
+{
+    Job j;
+    if (m_ring)
+    {
+        // skip over jobs that were canceled while sitting in the ring
+        uint64_t pos = 0;
+        bool revoked = true;
+        bool popped = false;
+        while (revoked)
+        {
+            if (!m_ring->tryPop(j, pos, revoked))
+            {
+                if (popped)
+                    spaceFreedInRing();
+                return false;
+            }
+            popped = true;
+        }
+        j.id = makeJobId(ringJobNumber(pos));
+        ASYNC_HOOK(onDequeue(j.id));
+        spaceFreedInRing();
+    }
+    else
+    {
+        Callbacks callbacks;
+        {
+            std::lock_guard<std::mutex> lock(m_jobsMutex);
+            if (!popNextUnprotected(j))
+                return false;
+            
+            assert(j.id != 0);
+            assert(j.func);
+            ASYNC_HOOK(onDequeue(j.id));
+            spaceFreedUnprotected(1, callbacks);
+        }
+        
+        for (auto& callback : callbacks)
+            callback();
+    }
+    
+    runJob(j);
+    return true;
+}
+
+size_t
+Queue::clear()
+{
+    size_t numCleared = 0;
+    if (m_ring)
+    {
+        Job j;
+        uint64_t pos = 0;
+        bool revoked = false;
+        bool popped = false;
+        while (m_ring->tryPop(j, pos, revoked))
+        {
+            if (!revoked)
+            {
+                numCleared++;
+                ASYNC_HOOK(onCancel(makeJobId(ringJobNumber(pos))));
+            }
+            j.func.reset();
+            popped = true;
+        }
+        
+        if (popped)
+            spaceFreedInRing();
+        countDropped(numCleared);
+        return numCleared;
+    }
+    
+    // destroyed outside the lock, like canceled jobs
+    std::vector<Jobs> cleared(m_bands.size());
+    Callbacks callbacks;
+    {
+        std::lock_guard<std::mutex> lock(m_jobsMutex);
+        for (size_t i=0; i<m_bands.size(); i++)
+        {
+            Band& band = m_bands[i];
+            numCleared += band.jobs.size() - band.numCanceled;
+            cleared[i].swap(band.jobs);
+            band.numCanceled = 0;
+            band.skipped = 0;
+        }
+        m_numQueued.store(0, std::memory_order_relaxed);
+        if (numCleared > 0)
+            spaceFreedUnprotected(numCleared, callbacks);
+    }
+    
+    countDropped(numCleared);
+#ifdef ASYNC_OBSERVER
+    for (const auto& jobs : cleared)
+    {
+        for (const auto& job : jobs)
+        {
+            if (job.func)
+                ASYNC_HOOK(onCancel(job.id));
+        }
+    }
+#endif
+    for (auto& callback : callbacks)
+        callback();
+    return numCleared;
+}
+
+bool
+Queue::full()
+{
+    std::lock_guard<std::mutex> lock(m_jobsMutex);
+    return fullUnprotected(1);
+}
+
+bool
+Queue::fullUnprotected(size_t count)
+{
+    // a queue with room left always takes a whole batch, even one larger than the
+    // bound, so bulk producers can't wait forever. the ring needs no lock here
+    size_t maxJobs = getMaxJobs();
+    if (maxJobs == 0)
+        return false;
+    
+    size_t size = sizeHint();
+    return size >= maxJobs || (size > 0 && size + count > maxJobs);
+}
+
+bool
+Queue::dropOldestUnprotected(Callbacks& dropped)
+{
+    for (auto it = m_bands.rbegin(); it != m_bands.rend(); ++it)
+    {
+        Band& band = *it;
+        if (band.jobs.empty())
+            continue;
+        
+        ASYNC_HOOK(onCancel(band.jobs.front().id));
+        dropped.push_back(std::move(band.jobs.front().func));
+        band.jobs.pop_front();
+        m_numQueued.fetch_sub(1, std::memory_order_relaxed);
+        popCanceledUnprotected(band);
+        countDropped(1);
+        return true;
+    }
+    return false;
+}
+
+bool
+Queue::dropOldestFromRing()
+{
+    // the dropped job is destroyed on return, no lock is held here
+    Job j;
+    uint64_t pos = 0;
+    bool revoked = true;
+    while (revoked)
+    {
+        if (!m_ring->tryPop(j, pos, revoked))
+            return false;
+    }
+    countDropped(1);
+    ASYNC_HOOK(onCancel(makeJobId(ringJobNumber(pos))));
+    return true;
+}
+
+void
+Queue::spaceFreedUnprotected(size_t count, Callbacks& callbacks)
+{
+    if (m_numBlocked > 0)
+    {
+        // a bulk producer may need more than the one slot a single pop frees
+        if (count == 1 && m_numBlockedBulk == 0)
+            m_spaceCond.notify_one();
+        else
+            m_spaceCond.notify_all();
+    }
+    
+    // release one callback per free slot, the rest wait for further pops
+    size_t maxJobs = getMaxJobs();
+    size_t size = sizeHint();
+    size_t numFree = (size < maxJobs) ? maxJobs - size : 0;
+    while (numFree-- > 0 && !m_spaceWaiters.empty())
+    {
+        callbacks.push_back(std::move(m_spaceWaiters.front()));
+        m_spaceWaiters.pop_front();
+    }
+    m_numSpaceWaiters.store(m_spaceWaiters.size(), std::memory_order_relaxed);
+}
+
+void
+Queue::spaceFreedInRing()
+{
+    // pairs with the fence in notifyWhenSpaceAvailable(), either this sees the new
+    // waiter or the waiter sees the slot that was just freed
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_numSpaceWaiters.load(std::memory_order_relaxed) == 0)
+        return;
+    
+    Callbacks callbacks;
+    {
+        std::lock_guard<std::mutex> lock(m_jobsMutex);
+        spaceFreedUnprotected(1, callbacks);
+    }
+    
+    for (auto& callback : callbacks)
+        callback();
+}
+
+void
+Queue::notifyWhenSpaceAvailable(JobFunc&& callback)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_jobsMutex);
+        m_spaceWaiters.push_back(std::move(callback));
+        m_numSpaceWaiters.store(m_spaceWaiters.size(), std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (fullUnprotected(1))
+            return;
+        
+        // there is room already
+        callback = std::move(m_spaceWaiters.back());
+        m_spaceWaiters.pop_back();
+        m_numSpaceWaiters.store(m_spaceWaiters.size(), std::memory_order_relaxed);
+    }
+    
+    callback();
+}
+
+void
+Queue::runJob(Job& job)
+{
+    ThreadStats& counters = threadStats();
+    increment(counters.numDequeued, 1);
+    
+    // the end is traced whenever the start was, even if tracing stops meanwhile
+    bool traced = Details::isTracing();
+    if (traced)
+        Details::traceJobStart(job.id);
+    ASYNC_HOOK(onStart(job.id));
+
+    if (!m_timeJobs)
+    {
+        job.func();
+    }
+    else
+    {
+        typedef std::chrono::steady_clock::duration Duration;
+        int64_t start = nowTicks();
+        increment(counters.waitTime[LatencyHistogram::bucketFor(Duration(start - job.enqueueTime))], 1);
+        job.func();
+        increment(counters.runTime[LatencyHistogram::bucketFor(Duration(nowTicks() - start))], 1);
+    }
+    
+    ASYNC_HOOK(onFinish(job.id));
+    if (traced)
+        Details::traceJobEnd(job.id);
+}
+
+void
+Queue::countDropped(size_t count)
+{
+    if (count > 0)
+        increment(threadStats().numDropped, count);
+}
+
+Queue::ThreadStats&
+Queue::threadStats()
+{
+    ThreadStatsCache& cache = s_threadStats;
+    if (cache.lastId == m_statsId)
+        return *static_cast<ThreadStats*>(cache.last);
+    
+    auto it = cache.entries.find(m_statsId);
+    if (it == cache.entries.end())
+    {
+        if (cache.entries.size() >= cache.sweepAt)
+        {
+            for (auto e = cache.entries.begin(); e != cache.entries.end(); )
+            {
+                if (e->second.owner.expired())
+                    e = cache.entries.erase(e);
+                else
+                    ++e;
+            }
+            cache.sweepAt = std::max<size_t>(16, 2 * cache.entries.size());
+        }
+        
+        // take over a block an exited thread handed back before adding one
+        std::shared_ptr<ThreadStats> stats;
+        {
+            std::lock_guard<std::mutex> lock(m_statsMutex);
+            for (auto& counters : m_threadStats)
+            {
+                bool expected = false;
+                if (!counters->inUse.load(std::memory_order_relaxed) && counters->inUse.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                {
+                    stats = counters;
+                    break;
+                }
+            }
+            
+            if (!stats)
+            {
+                stats = std::make_shared<ThreadStats>();
+                m_threadStats.push_back(stats);
+            }
+        }
+        
+        ThreadStatsCache::Entry entry;
+        entry.stats = stats.get();
+        entry.inUse = &stats->inUse;
+        entry.owner = stats;
+        it = cache.entries.insert(std::make_pair(m_statsId, entry)).first;
+    }
+    
+    cache.lastId = m_statsId;
+    cache.last = it->second.stats;
+    return *static_cast<ThreadStats*>(cache.last);
+}
+
+void
+Queue::increment(std::atomic<uint64_t>& counter, uint64_t count)
+{
+    // the calling thread is the only writer, so no read-modify-write is needed
+    counter.store(counter.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+}
+
+QueueStats
+Queue::stats()
+{
+    QueueStats stats;
+    stats.queueId = m_queueId;
+    {
+        std::lock_guard<std::mutex> lock(m_statsMutex);
+        for (auto& counters : m_threadStats)
+        {
+            stats.numEnqueued += counters->numEnqueued.load(std::memory_order_relaxed);
+            stats.numDequeued += counters->numDequeued.load(std::memory_order_relaxed);
+            stats.numCanceled += counters->numCanceled.load(std::memory_order_relaxed);
+            stats.numRejected += counters->numRejected.load(std::memory_order_relaxed);
+            stats.numDropped += counters->numDropped.load(std::memory_order_relaxed);
+            for (size_t b=0; b<LatencyHistogram::NumBuckets; b++)
+            {
+                stats.waitTime.buckets[b] += counters->waitTime[b].load(std::memory_order_relaxed);
+                stats.runTime.buckets[b] += counters->runTime[b].load(std::memory_order_relaxed);
+            }
+        }
+    }
+    
+    // the deque storage tracks its peak on enqueue, ring buffers only sample it here
+    stats.depth = sizeHint();
+    std::lock_guard<std::mutex> lock(m_jobsMutex);
+    m_peakDepth = std::max(m_peakDepth, stats.depth);
+    stats.peakDepth = m_peakDepth;
+    return stats;
+}
+
+std::mutex&
+Queue::getJobsMutex()
+{
+    return m_jobsMutex;
+}
+
+void
+Queue::newJobAdded()
+{
+}
+
+void
+Queue::newJobsAdded(size_t count)
+{
+    for (size_t i=0; i<count; i++)
+        newJobAdded();
+}
+
+bool
+Queue::enqueueLocal(Job&, uint64_t&)
+{
+    return false;
+}
+
+//////////////////////////////////////////////////////
+//////////////////////////////////////////////////////
+////////// Aysnc Queue functions
+//////////////////////////////////////////////////////
+//////////////////////////////////////////////////////
+
+std::vector<QueueStats> allQueueStats()
+{
+    // snapshot the registered queues, then take their stats without any lock
+    std::vector<Queue::Ptr> queues;
+    {
+        std::lock_guard<std::mutex> lock(s_registryMutex);
+        QueueTable* table = s_table.load();
+        for (size_t i=0; table && i<=table->mask; i++)
+        {
+            if (table->entries[i].queue)
+                queues.push_back(table->entries[i].queue);
+        }
+    }
+    
+    std::sort(queues.begin(), queues.end(), [](const Queue::Ptr& a, const Queue::Ptr& b) {
+        return a->getId() < b->getId();
+    });
+    
+    std::vector<QueueStats> stats;
+    stats.reserve(queues.size());
+    for (auto& q : queues)
+        stats.push_back(q->stats());
+    return stats;
+}
+
+QueueRef registerQueue(Queue::Ptr q)
+{
+    assert(q->getId() != TimerQueueId);
+    
+    std::vector<QueueTable*> reclaimable;
+    {
+        std::lock_guard<std::mutex> lock(s_registryMutex);
+        QueueTable* table = s_table.load();
+        if (table && table->find(q->getId()))
+            return QueueRef();
+        
+        size_t size = table ? table->size : 0;
+        QueueTable* copy = new QueueTable(size + 1);
+        if (table)
+        {
+            for (size_t i=0; i<=table->mask; i++)
+            {
+                if (table->entries[i].queue)
+                    copy->insert(table->entries[i].queueId, table->entries[i].queue);
+            }
+        }
+        copy->insert(q->getId(), q);
+        reclaimable = publishUnprotected(copy);
+    }
+    
+    for (QueueTable* table : reclaimable)
+        delete table;
+    
+    return QueueRef(q.get(), q->getId());
+}
+
+bool unregisterQueue(uint32_t queueId)
+{
+    std::vector<QueueTable*> reclaimable;
+    {
+        std::lock_guard<std::mutex> lock(s_registryMutex);
+        QueueTable* table = s_table.load();
+        if (!table || !table->find(queueId))
+            return false;
+        
+        QueueTable* copy = new QueueTable(table->size - 1);
+        for (size_t i=0; i<=table->mask; i++)
+        {
+            if (table->entries[i].queue && table->entries[i].queueId != queueId)
+                copy->insert(table->entries[i].queueId, table->entries[i].queue);
+        }
+        reclaimable = publishUnprotected(copy);
+    }
+    
+    for (QueueTable* table : reclaimable)
+        delete table;
+    return true;
+}
+
+Queue::Ptr getQueue(uint32_t queueId)
+{
+    ReadGuard guard;
+    Queue* q = guard.find(queueId);
+    return q ? q->shared_from_this() : Queue::Ptr();
+}
+
+uint64_t enqueue(uint32_t queueId, JobFunc&& func, uint32_t priority)
+{
+    // no Queue::Ptr copy, the guard keeps the queue alive
+    ReadGuard guard;
+    Queue* q = guard.find(queueId);
+    if (!q)
+        return 0;
+    
+    return q->enqueue(std::move(func), priority);
+}
+
+bool cancel(uint64_t jobId)
+{
+    uint32_t queueId = jobId >> 32;
+    if (queueId == TimerQueueId)
+        return Details::cancelTimer(jobId);
+    
+    ReadGuard guard;
+    Queue* q = guard.find(queueId);
+    if (!q)
+        return false;
+    
+    return q->cancel(jobId);
+}
+
+//////////////////////////////////////////////////////
+//////////////////////////////////////////////////////
+////////// ThreadPoolQueue
+//////////////////////////////////////////////////////
+//////////////////////////////////////////////////////
+
+thread_local ThreadPoolQueue::Worker* ThreadPoolQueue::s_currentWorker = nullptr;
+
+ThreadPoolQueue::ThreadPoolQueue(uint32_t numThreads)
+{
+    init(numThreads, Options());
+}
+
+ThreadPoolQueue::ThreadPoolQueue(uint32_t queueId, uint32_t numThreads)
+    : Queue(queueId)
+{
+    init(numThreads, Options());
+}
+
+ThreadPoolQueue::ThreadPoolQueue(uint32_t queueId, uint32_t numThreads, const Options& options)
+    : Queue(queueId, options)
+{
+    init(numThreads, options);
+}
+
+ThreadPoolQueue::~ThreadPoolQueue()
+{
+    stop();
+}
+
+void
+ThreadPoolQueue::stop()
+{
+    stopWorkers();
+}
+
+ThreadPoolQueue::ShutdownReport
+ThreadPoolQueue::drain(std::chrono::steady_clock::time_point deadline)
+{
+    ShutdownReport report;
+    Clock::time_point start = Clock::now();
+    
+    // workers keep running (and accepting follow-up jobs) until idle or out of time
+    std::chrono::microseconds backoff(50);
+    while (!isIdle() && Clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(backoff);
+        backoff = std::min(backoff * 2, std::chrono::microseconds(1000));
+    }
+    report.drainTime = Clock::now() - start;
+    
+    finishShutdown(report);
+    return report;
+}
+
+ThreadPoolQueue::ShutdownReport
+ThreadPoolQueue::shutdownNow()
+{
+    ShutdownReport report;
+    finishShutdown(report);
+    return report;
+}
+
+void
+ThreadPoolQueue::finishShutdown(ShutdownReport& report)
+{
+    // drop queued jobs first so workers stop picking them up
+    Clock::time_point start = Clock::now();
+    report.numLeft += clear();
+    report.cancelTime = Clock::now() - start;
+    
+    // jobs already running are finished, whatever they enqueue meanwhile is dropped too
+    start = Clock::now();
+    report.numLeft += stopWorkers();
+    report.joinTime = Clock::now() - start;
+    
+    start = Clock::now();
+    report.numLeft += clear();
+    report.cancelTime += Clock::now() - start;
+}
+
+bool
+ThreadPoolQueue::isIdle()
+{
+    if (!emptyHint())
+        return false;
+    
+    std::lock_guard<std::mutex> lock(m_workersMutex);
+    for (auto& worker : m_workers)
+    {
+        if (worker->busy || !worker->jobs.empty())
+            return false;
+    }
+    
+    // a job enqueued by the last busy worker is visible once that worker is idle
+    return emptyHint();
+}
+
+size_t
+ThreadPoolQueue::stopWorkers()
+{
+    {
+        std::lock_guard<std::mutex> lock(getJobsMutex());
+        if (!m_running)
+            return 0;
+        
+        m_running = false;
+        m_cond.notify_all();
+    }
+    
+    // no worker is spawned or reaped once m_running is false, so taking both lists
+    // leaves every worker owned here. one still retiring finds itself gone from
+    // m_workers and just exits
+    std::vector<std::unique_ptr<Worker>> workers;
+    {
+        std::lock_guard<std::mutex> lock(m_workersMutex);
+        workers = std::move(m_workers);
+        m_workers.clear();
+        for (auto& worker : m_retired)
+            workers.push_back(std::move(worker));
+        m_retired.clear();
+    }
+    
+    for (auto& worker : workers)
+    {
+        if (worker->thread.joinable())
+            worker->thread.join();
+    }
+    m_victims.clear();
+    
+    // jobs left on worker deques are dropped, just like jobs left in the queue
+    size_t numDropped = 0;
+    for (auto& worker : workers)
+    {
+        JobSlot* slot = nullptr;
+        while (worker->jobs.take(slot))
+        {
+            ASYNC_HOOK(onCancel(slot->job.id));
+            slot->job.func.reset();
+            numDropped++;
+        }
+    }
+    countDropped(numDropped);
+    return numDropped;
+}
+
+bool
+ThreadPoolQueue::isWorkerThread()
+{
+    return s_currentWorker != nullptr;
+}
+
+bool
+ThreadPoolQueue::helpOnCurrentWorker()
+{
+    Worker* worker = s_currentWorker;
+    if (!worker)
+        return false;
+    
+    ThreadPoolQueue* queue = worker->queue;
+    return queue->m_running && queue->runNextForWorker(worker);
+}
+
+uint32_t
+ThreadPoolQueue::getNumThreads() const
+{
+    return m_numThreads;
+}
+
+uint64_t
+ThreadPoolQueue::getNumSpawned() const
+{
+    return m_numSpawned;
+}
+
+uint64_t
+ThreadPoolQueue::getNumRetired() const
+{
+    return m_numRetired;
+}
+
+QueueStats
+ThreadPoolQueue::stats()
+{
+    QueueStats stats = Queue::stats();
+    
+    typedef std::chrono::steady_clock::duration Duration;
+    int64_t now = nowTicks();
+    std::lock_guard<std::mutex> lock(m_workersMutex);
+    for (auto& worker : m_workers)
+    {
+        int64_t started = worker->started.load(std::memory_order_relaxed);
+        if (started == 0)
+            continue;
+        
+        // count the current idle period too
+        int64_t idle = worker->idleTime.load(std::memory_order_relaxed);
+        int64_t idleSince = worker->idleSince.load(std::memory_order_relaxed);
+        if (idleSince != 0)
+            idle += now - idleSince;
+        
+        WorkerStats workerStats;
+        workerStats.idleTime = Duration(idle);
+        workerStats.busyTime = Duration(std::max<int64_t>(0, now - started - idle));
+        stats.workers.push_back(workerStats);
+    }
+    return stats;
+}
+
+void
+ThreadPoolQueue::init(uint32_t numThreads, const Options& options)
+{
+    m_workStealing = options.workStealing;
+    m_placement = options.placement;
+    m_spinCount = options.spinCount;
+    m_yieldCount = options.yieldCount;
+    
+    // thieves walk the worker list without a lock, so work stealing pools don't grow
+    m_elastic = options.maxThreads > numThreads && !m_workStealing;
+    m_minThreads = numThreads;
+    m_maxThreads = m_elastic ? options.maxThreads : numThreads;
+    m_spawnQueueDepth = std::max<size_t>(1, options.spawnQueueDepth);
+    m_spawnWaitTime = options.spawnWaitTime;
+    m_keepAlive = options.keepAlive;
+    m_numThreads = numThreads;
+    markIdle();
+    
+    Async::CpuSet cpus = options.cpus.empty() ? getAvailableCpus() : options.cpus;
+    switch (m_placement)
+    {
+        case Placement::None:
+            break;
+        case Placement::Cores:
+            for (uint32_t cpu : cpus)
+                m_cpuGroups.push_back(Async::CpuSet(1, cpu));
+            break;
+        case Placement::CpuSet:
+            m_cpuGroups.push_back(cpus);
+            break;
+        case Placement::NumaNode:
+            m_cpuGroups.push_back(getNumaNodeCpus(options.numaNode));
+            break;
+        case Placement::NumaSpread:
+            for (uint32_t node=0; node<getNumNumaNodes(); node++)
+            {
+                Async::CpuSet nodeCpus = getNumaNodeCpus(node);
+                if (!nodeCpus.empty())
+                    m_cpuGroups.push_back(nodeCpus);
+            }
+            break;
+    }
+    
+    // create all workers before starting any thread, so thieves see a stable list
+    for (uint32_t i=0; i<numThreads; i++)
+    {
+        std::unique_ptr<Worker> worker(new Worker);
+        worker->queue = this;
+        worker->index = i;
+        worker->rng = 2654435761u * (i + 1);
+        worker->cpus = workerCpus(i);
+        if (m_workStealing)
+            m_victims.push_back(worker.get());
+        m_workers.push_back(std::move(worker));
+    }
+    
+    // elastic workers may retire (and leave m_workers) as soon as they start
+    std::lock_guard<std::mutex> lock(m_workersMutex);
+    for (auto& worker : m_workers)
+    {
+        worker->thread = std::thread(&ThreadPoolQueue::run, this, worker.get());
+    }
+}
+
+void
+ThreadPoolQueue::run(Worker* worker)
+{
+    s_currentWorker = worker;
+    if (!worker->cpus.empty())
+        pinCurrentThread(worker->cpus);
+    worker->started = nowTicks();
+    
+    while (m_running)
+    {
+        // execute any work on the queue
+        while (m_running && runNextForWorker(worker)) {}
+        
+        // then wait until there's more, spinning a while before parking
+        worker->busy = false;
+        int64_t idleSince = nowTicks();
+        worker->idleSince.store(idleSince, std::memory_order_relaxed);
+        if (m_elastic)
+            markIdle();
+        if (m_running && !pollForWork() && !park())
+        {
+            retireWorker(worker);
+            break;
+        }
+        worker->idleTime.fetch_add(nowTicks() - idleSince, std::memory_order_relaxed);
+        worker->idleSince.store(0, std::memory_order_relaxed);
+        worker->busy = true;
+    }
+    
+    s_currentWorker = nullptr;
 }
 
-//////////////////////////////////////////////////////
-//////////////////////////////////////////////////////
-////////// Queue
-//////////////////////////////////////////////////////
-//////////////////////////////////////////////////////
-
-Queue::Queue()
+bool
+ThreadPoolQueue::runNextForWorker(Worker* worker)
 {
-    std::lock_guard<std::mutex> lock(s_queueIdMutex);
-    m_queueId = s_nextQueueId;
-    s_nextQueueId++;
+    if (!m_workStealing)
+        return runNext();
+    
+    // own deque first (LIFO, likely still in cache), then the shared queue, then steal
+    JobSlot* slot = nullptr;
+    if (worker->jobs.take(slot))
+    {
+        ASYNC_HOOK(onDequeue(slot->job.id));
+        runJob(slot->job);
+        releaseSlot(slot);
+        return true;
+    }
+    
+    if (runNext())
+        return true;
+    
+    return steal(worker);
 }
 
-Queue::Queue(uint32_t queueId)
-    : m_queueId(queueId)
+bool
+ThreadPoolQueue::steal(Worker* thief)
 {
+    size_t numWorkers = m_victims.size();
+    if (numWorkers < 2)
+        return false;
+    
+    // xorshift32 to pick a random first victim
+    uint32_t x = thief->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    thief->rng = x;
+    
+    size_t start = x % numWorkers;
+    for (size_t i=0; i<numWorkers; i++)
+    {
+        Worker* victim = m_victims[(start + i) % numWorkers];
+        if (victim == thief)
+            continue;
+        
+        JobSlot* slot = nullptr;
+        if (victim->jobs.steal(slot))
+        {
+            ASYNC_HOOK(onDequeue(slot->job.id));
+            runJob(slot->job);
+            releaseSlot(slot);
+            return true;
+        }
+    }
+    
+    return false;
 }
 
-Queue::~Queue()
+ThreadPoolQueue::JobSlot*
+ThreadPoolQueue::allocateSlot(Worker* worker)
 {
+    // owner thread only
+    if (!worker->freeSlots)
+        worker->freeSlots = worker->remoteFreeSlots.exchange(nullptr, std::memory_order_acquire);
+    
+    if (!worker->freeSlots)
+    {
+        std::unique_ptr<JobSlot[]> slab(new JobSlot[SlotsPerSlab]);
+        for (size_t i=0; i<SlotsPerSlab; i++)
+        {
+            slab[i].owner = worker;
+            slab[i].nextFree = (i + 1 < SlotsPerSlab) ? &slab[i + 1] : nullptr;
+        }
+        worker->freeSlots = &slab[0];
+        worker->slabs.push_back(std::move(slab));
+    }
+    
+    JobSlot* slot = worker->freeSlots;
+    worker->freeSlots = slot->nextFree;
+    return slot;
 }
 
-uint32_t
-Queue::getId()
+void
+ThreadPoolQueue::releaseSlot(JobSlot* slot)
 {
-    return m_queueId;
+    // the callable goes first, on the thread that ran it
+    slot->job.func.reset();
+    
+    Worker* owner = slot->owner;
+    if (owner == s_currentWorker)
+    {
+        slot->nextFree = owner->freeSlots;
+        owner->freeSlots = slot;
+        return;
+    }
+    
+    // push only, the owner takes the whole list at once, so there is no ABA
+    JobSlot* head = owner->remoteFreeSlots.load(std::memory_order_relaxed);
+    do
+    {
+        slot->nextFree = head;
+    }
+    while (!owner->remoteFreeSlots.compare_exchange_weak(head, slot, std::memory_order_release, std::memory_order_relaxed));
 }
 
 bool
-Queue::cancel(uint64_t jobId)
+ThreadPoolQueue::pollForWork()
 {
-    std::lock_guard<std::mutex> lock(m_jobsMutex);
-    
-    uint32_t queueId = jobId >> 32;
-    if (queueId != m_queueId)
+    // only looks at lock-free hints, so spinning workers don't contend with
+    // producers for the jobs mutex
+    auto hasWork = [this]() {
+        if (!m_running || !emptyHint())
+            return true;
+        
+        for (auto worker : m_victims)
+        {
+            if (!worker->jobs.empty())
+                return true;
+        }
         return false;
+    };
     
-    Jobs::iterator it = std::find_if(m_jobs.begin(), m_jobs.end(), [jobId](const Job& j) {
-        return j.id == jobId;
-    });
+    for (uint32_t i=0; i<m_spinCount; i++)
+    {
+        if (hasWork())
+            return true;
+        Util::cpuRelax();
+    }
     
-    if (it == m_jobs.end())
-        return false;
+    for (uint32_t i=0; i<m_yieldCount; i++)
+    {
+        if (hasWork())
+            return true;
+        std::this_thread::yield();
+    }
     
-    m_jobs.erase(it);
-    return true;
+    return false;
 }
 
 bool
-Queue::empty()
+ThreadPoolQueue::park()
 {
-    std::lock_guard<std::mutex> lock(m_jobsMutex);
-    return emptyUnprotected();
+    // returns false when an elastic worker should retire
+    std::unique_lock<std::mutex> lock(getJobsMutex());
+    m_sleepers++;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    
+    bool keep = true;
+    while (m_running && !hasWorkUnprotected())
+    {
+        if (!m_elastic)
+        {
+            m_cond.wait(lock);
+            continue;
+        }
+        
+        if (m_cond.wait_for(lock, m_keepAlive) == std::cv_status::no_timeout || hasWorkUnprotected())
+            continue;
+        
+        uint32_t numThreads = m_numThreads;
+        while (numThreads > m_minThreads)
+        {
+            if (m_numThreads.compare_exchange_weak(numThreads, numThreads - 1))
+            {
+                keep = false;
+                break;
+            }
+        }
+        if (!keep)
+            break;
+    }
+    
+    m_sleepers--;
+    return keep;
 }
 
-bool
-Queue::emptyUnprotected()
+void
+ThreadPoolQueue::markIdle()
 {
-    return m_jobs.empty();
+    m_lastIdle.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
 }
 
-bool
-Queue::runNext()
+void
+ThreadPoolQueue::maybeSpawnWorker()
 {
-    Job j;
+    // called by producers that found no parked worker
+    if (emptyHint() || m_numThreads.load(std::memory_order_relaxed) >= m_maxThreads)
+        return;
+    
+    if (sizeHint() < m_spawnQueueDepth)
     {
-        std::lock_guard<std::mutex> lock(m_jobsMutex);
-        if (m_jobs.empty())
-            return false;
-        
-        j = m_jobs.front();
-        assert(j.id != 0);
-        m_jobs.pop_front();
+        std::chrono::steady_clock::duration busy(std::chrono::steady_clock::now().time_since_epoch().count() - m_lastIdle.load(std::memory_order_relaxed));
+        if (busy < m_spawnWaitTime)
+            return;
     }
     
-    j.func();
-    return true;
+    // one spawn at a time, producers that lose the race just move on
+    if (m_spawning.exchange(true))
+        return;
+    
+    uint32_t numThreads = m_numThreads;
+    while (numThreads < m_maxThreads)
+    {
+        if (m_numThreads.compare_exchange_weak(numThreads, numThreads + 1))
+        {
+            startWorker();
+            m_numSpawned++;
+            
+            // give the new worker a full spawnWaitTime before judging the backlog again
+            markIdle();
+            break;
+        }
+    }
+    
+    m_spawning = false;
 }
 
-std::mutex&
-Queue::getJobsMutex()
+void
+ThreadPoolQueue::startWorker()
 {
-    return m_jobsMutex;
+    std::lock_guard<std::mutex> lock(m_workersMutex);
+    
+    // after stop the retired workers belong to stopWorkers(), which joins them
+    if (!m_running)
+    {
+        m_numThreads--;
+        return;
+    }
+    
+    // reap workers that retired since the last spawn, their threads are exiting
+    for (auto& worker : m_retired)
+        worker->thread.join();
+    m_retired.clear();
+    
+    std::unique_ptr<Worker> worker(new Worker);
+    worker->queue = this;
+    worker->index = static_cast<uint32_t>(m_workers.size());
+    worker->rng = 2654435761u * (worker->index + 1);
+    worker->cpus = workerCpus(worker->index);
+    worker->thread = std::thread(&ThreadPoolQueue::run, this, worker.get());
+    m_workers.push_back(std::move(worker));
+}
+
+Async::CpuSet
+ThreadPoolQueue::workerCpus(uint32_t index) const
+{
+    if (m_cpuGroups.empty())
+        return Async::CpuSet();
+    
+    return m_cpuGroups[index % m_cpuGroups.size()];
 }
 
 void
-Queue::newJobAdded()
+ThreadPoolQueue::retireWorker(Worker* worker)
 {
+    std::lock_guard<std::mutex> lock(m_workersMutex);
+    for (auto it = m_workers.begin(); it != m_workers.end(); ++it)
+    {
+        if (it->get() == worker)
+        {
+            m_retired.push_back(std::move(*it));
+            m_workers.erase(it);
+            break;
+        }
+    }
+    m_numRetired++;
 }
 
-//////////////////////////////////////////////////////
-//////////////////////////////////////////////////////
-////////// Aysnc Queue functions
-//////////////////////////////////////////////////////
-//////////////////////////////////////////////////////
+bool
+ThreadPoolQueue::hasWorkUnprotected()
+{
+    if (!emptyUnprotected())
+        return true;
+    
+    for (auto worker : m_victims)
+    {
+        if (!worker->jobs.empty())
+            return true;
+    }
+    
+    return false;
+}
+
+void
+ThreadPoolQueue::newJobAdded()
+{
+    // pairs with the sleeper increment in run(), so either the worker sees the
+    // new job or we see the sleeper
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_sleepers.load() == 0)
+    {
+        if (m_elastic)
+            maybeSpawnWorker();
+        return;
+    }
+    
+    // lock-free pushes happen outside the jobs mutex, so pass through it once
+    // to make sure a worker between its empty check and wait() sees the notify
+    {
+        std::lock_guard<std::mutex> lock(getJobsMutex());
+    }
+    
+    m_cond.notify_one();
+}
 
-void registerQueue(Queue::Ptr q)
+void
+ThreadPoolQueue::newJobsAdded(size_t count)
 {
-    std::lock_guard<std::mutex> lock(s_queuesMutex);
-    s_queues.insert(std::make_pair(q->getId(), q));
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint32_t sleepers = m_sleepers.load();
+    if (sleepers == 0)
+    {
+        if (m_elastic)
+            maybeSpawnWorker();
+        return;
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(getJobsMutex());
+    }
+    
+    // wake min(count, sleepers) workers
+    if (count >= sleepers)
+    {
+        m_cond.notify_all();
+    }
+    else
+    {
+        for (size_t i=0; i<count; i++)
+            m_cond.notify_one();
+    }
 }
 
-bool unregisterQueue(uint32_t queueId)
+bool
+ThreadPoolQueue::enqueueLocal(Job& job, uint64_t& jobId)
 {
-    std::lock_guard<std::mutex> lock(s_queuesMutex);
+    Worker* worker = s_currentWorker;
+    if (!m_workStealing || !worker || worker->queue != this)
+        return false;
     
-    QueueMap::iterator it = s_queues.find(queueId);
-    if (it == s_queues.end())
+    // lower priorities go through the shared bands so they can't jump the line
+    if (job.priority != 0)
         return false;
     
-    s_queues.erase(it);
+    jobId = makeJobId(LocalJobBit | (m_nextLocalJobNumber++ & JobCounterMask));
+    job.id = jobId;
+    JobSlot* slot = allocateSlot(worker);
+    slot->job = std::move(job);
+    worker->jobs.push(slot);
     return true;
 }
 
-template <>
-uint64_t enqueue<VoidFunc>(uint32_t queueId, const VoidFunc& func)
+
+std::vector<ThreadPoolQueue::Ptr> createNumaQueues(uint32_t firstQueueId, uint32_t threadsPerNode, const ThreadPoolQueue::Options& options)
 {
-    Queue::Ptr q;
+    std::vector<ThreadPoolQueue::Ptr> queues;
+    uint32_t numNodes = getNumNumaNodes();
+    for (uint32_t node=0; node<numNodes; node++)
     {
-        std::lock_guard<std::mutex> lock(s_queuesMutex);
-        QueueMap::iterator it = s_queues.find(queueId);
-        if (it == s_queues.end())
-            return 0;
+        ThreadPoolQueue::Options nodeOptions = options;
+        nodeOptions.placement = ThreadPoolQueue::Placement::NumaNode;
+        nodeOptions.numaNode = node;
         
-        q = it->second;
+        ThreadPoolQueue::Ptr queue = std::make_shared<ThreadPoolQueue>(firstQueueId + node, threadsPerNode, nodeOptions);
+        registerQueue(queue);
+        queues.push_back(queue);
+    }
+    return queues;
+}
+
+//////////////////////////////////////////////////////
+//////////////////////////////////////////////////////
+////////// SerialQueue
+//////////////////////////////////////////////////////
+//////////////////////////////////////////////////////
+
+// runs one drain of a serial queue on its target queue, and keeps the serial queue
+// alive until then. one destroyed without running (refused by a full target, or
+// dropped by clear() or a shutdown) hands the drain back, so the serial queue doesn't
+// stall with m_scheduled set
+class SerialQueue::DrainJob
+{
+public:
+    explicit DrainJob(SerialQueue::Ptr queue)
+        : m_queue(std::move(queue))
+    {
     }
     
-    assert(q);
-    if (!q)
-        return 0;
+    DrainJob(DrainJob&& other) noexcept
+        : m_queue(std::move(other.m_queue))
+    {
+    }
+    
+    ~DrainJob()
+    {
+        if (m_queue)
+            m_queue->drainDropped();
+    }
+    
+    void operator()()
+    {
+        SerialQueue::Ptr queue = std::move(m_queue);
+        queue->drain();
+    }
     
-    return q->enqueue(func);
+private:
+    SerialQueue::Ptr m_queue;
+};
+
+SerialQueue::SerialQueue(Queue::Ptr target)
+    : m_target(target)
+{
+    init(Options());
 }
 
-bool cancel(uint64_t jobId)
+SerialQueue::SerialQueue(uint32_t queueId, Queue::Ptr target)
+    : Queue(queueId)
+    , m_target(target)
 {
-    uint32_t queueId = jobId >> 32;
+    init(Options());
+}
+
+SerialQueue::SerialQueue(uint32_t queueId, Queue::Ptr target, const Options& options)
+    : Queue(queueId, options)
+    , m_target(target)
+{
+    init(options);
+}
+
+void
+SerialQueue::init(const Options& options)
+{
+    assert(m_target);
+    m_maxJobsPerDrain = std::max(1u, options.maxJobsPerDrain);
+    m_targetPriority = options.targetPriority;
+}
+
+Queue::Ptr
+SerialQueue::getTarget() const
+{
+    return m_target;
+}
+
+void
+SerialQueue::scheduleDrain()
+{
+    SerialQueue::Ptr self = std::static_pointer_cast<SerialQueue>(shared_from_this());
+    m_target->enqueue(DrainJob(std::move(self)), m_targetPriority);
+}
+
+void
+SerialQueue::drainDropped()
+{
+    // pairs with the fence in newJobAdded(), like the end of drain()
+    m_scheduled.store(false);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (empty())
+        return;
     
-    Queue::Ptr q;
+    // a full target gets another drain once it has room. otherwise (a stopped
+    // target, or one whose jobs were cleared) the next enqueue schedules one
+    if (m_target->full())
     {
-        std::lock_guard<std::mutex> lock(s_queuesMutex);
-        QueueMap::iterator it = s_queues.find(queueId);
-        if (it == s_queues.end())
-            return false;
+        SerialQueue::Ptr self = std::static_pointer_cast<SerialQueue>(shared_from_this());
+        m_target->notifyWhenSpaceAvailable([self]() {
+            self->newJobAdded();
+        });
+    }
+}
+
+void
+SerialQueue::drain()
+{
+    // only one drain is ever scheduled, so jobs never run concurrently
+    for (uint32_t i=0; i<m_maxJobsPerDrain; i++)
+    {
+        if (runNext())
+            continue;
         
-        q = it->second;
+        // out of jobs. pairs with the fence in newJobAdded(), so either we see a job
+        // enqueued after the failed runNext() or its producer sees m_scheduled false
+        m_scheduled.store(false);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (empty() || m_scheduled.exchange(true))
+            return;
     }
     
-    assert(q);
-    if (!q)
-        return false;
-    
-    return q->cancel(jobId);
+    // give other queues sharing the target a turn
+    scheduleDrain();
+}
+
+void
+SerialQueue::newJobAdded()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!m_scheduled.exchange(true))
+        scheduleDrain();
+}
+
+void
+SerialQueue::newJobsAdded(size_t)
+{
+    newJobAdded();
 }
 
 //////////////////////////////////////////////////////
 //////////////////////////////////////////////////////
-////////// ThreadPoolQueue
+////////// RunLoopQueue
 //////////////////////////////////////////////////////
 //////////////////////////////////////////////////////
 
-ThreadPoolQueue::ThreadPoolQueue(uint32_t numThreads)
+RunLoopQueue::RunLoopQueue()
 {
-    init(numThreads);
 }
 
-ThreadPoolQueue::ThreadPoolQueue(uint32_t queueId, uint32_t numThreads)
+RunLoopQueue::RunLoopQueue(uint32_t queueId)
     : Queue(queueId)
 {
-    init(numThreads);
 }
 
-ThreadPoolQueue::~ThreadPoolQueue()
+RunLoopQueue::RunLoopQueue(uint32_t queueId, const Options& options)
+    : Queue(queueId, options)
 {
-    stop();
+}
+
+size_t
+RunLoopQueue::runAllPending()
+{
+    // jobs enqueued by the ones we run wait for the next call, so a job that
+    // re-enqueues itself cannot keep us here forever
+    size_t pending = sizeHint();
+    size_t numRun = 0;
+    while (numRun < pending && runNext())
+        numRun++;
+    return numRun;
+}
+
+size_t
+RunLoopQueue::runFor(std::chrono::steady_clock::duration duration)
+{
+    return run(std::function<bool()>(), Clock::now() + duration);
+}
+
+size_t
+RunLoopQueue::runUntil(const std::function<bool()>& done)
+{
+    return run(done, Clock::time_point::max());
 }
 
 void
-ThreadPoolQueue::stop()
+RunLoopQueue::wakeUp()
 {
     {
         std::lock_guard<std::mutex> lock(getJobsMutex());
-        if (!m_running)
-            return;
-        
-        m_running = false;
-        m_cond.notify_all();
+        m_wakeUp = true;
     }
-    
-    for (auto& thread : m_threads)
+    m_cond.notify_one();
+}
+
+size_t
+RunLoopQueue::run(const std::function<bool()>& done, Clock::time_point deadline)
+{
+    bool timed = deadline != Clock::time_point::max();
+    size_t numRun = 0;
+    while (!done || !done())
     {
-        thread.join();
+        if (timed && Clock::now() >= deadline)
+            break;
+        
+        if (runNext())
+        {
+            numRun++;
+            continue;
+        }
+        
+        park(deadline);
     }
-    m_threads.clear();
+    return numRun;
 }
 
 void
-ThreadPoolQueue::init(uint32_t numThreads)
+RunLoopQueue::park(Clock::time_point deadline)
 {
-    for (uint32_t i=0; i<numThreads; i++)
+    std::unique_lock<std::mutex> lock(getJobsMutex());
+    m_parked.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    
+    // a single wake-up (job, wakeUp() or deadline) returns to run() to re-check done()
+    if (!m_wakeUp && emptyUnprotected())
     {
-        std::thread worker(&ThreadPoolQueue::run, this);
-        m_threads.push_back(std::move(worker));
+        if (deadline == Clock::time_point::max())
+            m_cond.wait(lock);
+        else
+            m_cond.wait_until(lock, deadline);
     }
+    
+    m_wakeUp = false;
+    m_parked.store(false);
 }
 
 void
-ThreadPoolQueue::run()
+RunLoopQueue::newJobAdded()
 {
-    while (m_running)
-    {
-        {
-            // wait until there's work to do
-            std::unique_lock<std::mutex> lock(getJobsMutex());
-            while (m_running && emptyUnprotected())
-                m_cond.wait(lock);
-        }
+    // pairs with the fence in park(), so either the owner sees the new job or we
+    // see it parked
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!m_parked.load())
+        return;
     
-        // execute any work on the queue
-        while (m_running && runNext()) {}
+    // lock-free pushes happen outside the jobs mutex, so pass through it once to
+    // make sure the owner between its empty check and wait() sees the notify
+    {
+        std::lock_guard<std::mutex> lock(getJobsMutex());
     }
+    
+    m_cond.notify_one();
 }
 
 void
-ThreadPoolQueue::newJobAdded()
+RunLoopQueue::newJobsAdded(size_t)
 {
-    m_cond.notify_one();
+    newJobAdded();
 }
 
 
@@ -1,7 +1,16 @@
 #pragma once
 
+#include "Async/Affinity.h"
 #include "Async/Base.h"
+#include "Async/JobFunc.h"
+#include "Async/Stats.h"
+#include "Util/CpuRelax.h"
+#include "Util/MPMCRingBufferT.h"
+#include "Util/WorkStealingDequeT.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <deque>
 #include <functional>
 #include <memory>
@@ -20,77 +29,358 @@ public:
     typedef std::shared_ptr<Queue> Ptr;
     typedef std::weak_ptr<Queue> WeakPtr;
     
+    enum class Storage
+    {
+        Deque,      // std::deque guarded by the jobs mutex, bounded only if maxJobs is set
+        RingBuffer  // bounded lock-free MPMC ring buffer
+    };
+    
+    // what enqueue() does when a bounded queue is full
+    enum class Overflow
+    {
+        Block,      // wait for space (ring buffer producers yield instead of sleeping)
+        Fail,       // drop the new job and return 0, like tryEnqueue()
+        DropOldest, // drop the oldest job of the lowest priority band that has any
+        RunOnCaller // run the new job on the calling thread and return 0
+    };
+    
+    static const uint32_t MaxPriorities = 4;
+    
+    struct Options
+    {
+        Storage storage = Storage::Deque;
+        size_t capacity = 4096; // RingBuffer only, rounded up to a power of two
+        
+        // Deque only. live jobs the queue may hold, 0 for no limit. jobs a pool
+        // worker enqueues on its own deque (workStealing) don't count. a blocked
+        // producer that is also a consumer of the queue may deadlock it
+        size_t maxJobs = 0;
+        Overflow overflow = Overflow::Block;
+        
+        // record the wait and run time histograms of stats(), which costs three
+        // clock reads per job
+        bool timeJobs = false;
+        
+        // Deque only. number of priority bands, priority 0 is served first
+        uint32_t numPriorities = 1;
+        
+        // a band that has been passed over this many times in favor of higher
+        // priority bands is served next (0 disables aging, allowing starvation)
+        uint32_t agingLimit = 32;
+    };
+    
     Queue();
     Queue(uint32_t queueId);
+    Queue(uint32_t queueId, const Options& options);
     virtual ~Queue();
     
     uint32_t getId();
+    Storage getStorage() const;
+    uint32_t getNumPriorities() const;
+    Overflow getOverflow() const;
     
+    // capacity of the ring buffer or maxJobs, 0 when unbounded
+    size_t getMaxJobs() const;
+    
+    // priorities past the lowest band are clamped to it. a full queue applies its
+    // overflow policy, 0 is returned if the job did not end up in the queue. empty
+    // callables (a null function pointer or std::function) are rejected
     template <typename F>
-    uint64_t enqueue(const F& func)
+    uint64_t enqueue(F&& func, uint32_t priority = 0)
     {
-        uint64_t jobId = m_queueId;
-        jobId <<= 32;
-        jobId += m_nextJobNumber++;
-        
+        Job job;
+        job.func = JobFunc(std::forward<F>(func));
+        job.priority = clampPriority(priority);
+        return enqueueJob(std::move(job), m_overflow);
+    }
+    
+    // returns 0 (destroying func) instead of applying the overflow policy when full
+    template <typename F>
+    uint64_t tryEnqueue(F&& func, uint32_t priority = 0)
+    {
+        Job job;
+        job.func = JobFunc(std::forward<F>(func));
+        job.priority = clampPriority(priority);
+        return enqueueJob(std::move(job), Overflow::Fail);
+    }
+    
+    // enqueues every callable in [first, last) with a single lock acquisition and
+    // a single wakeup. the jobs get consecutive ids, returns the first one
+    // (or 0 for an empty range), see offsetJobId(). on a full queue the overflow
+    // policy applies to the batch as a whole: Block waits until it fits (or the
+    // queue is empty), Fail drops all of it and RunOnCaller runs all of it. a batch
+    // holding an empty callable is rejected as a whole
+    template <typename Iter>
+    uint64_t enqueueBulk(Iter first, Iter last, uint32_t priority = 0)
+    {
+        std::vector<Job> jobs;
+        for (; first != last; ++first)
         {
-            std::lock_guard<std::mutex> lock(m_jobsMutex);
-            
             Job job;
-            job.id = jobId;
-            job.func = [=]() {
-                func();
-            };
-            m_jobs.push_back(job);
+            job.func = JobFunc(*first);
+            job.priority = clampPriority(priority);
+            jobs.push_back(std::move(job));
         }
-        
-        newJobAdded();
-        return jobId;
+        return enqueueJobs(jobs);
     }
     
+    // id of the job offset places after jobId in the same bulk enqueue
+    static uint64_t offsetJobId(uint64_t jobId, uint32_t offset);
+    
     bool cancel(uint64_t jobId);
     bool empty();
+    bool full();
     bool runNext();
     
+    // calls callback once the queue has room for another job: right away on the
+    // calling thread if it has room now, otherwise on the thread that makes room.
+    // room is not reserved, a racing producer may take it first. callbacks still
+    // waiting when the queue is destroyed are dropped without being called
+    void notifyWhenSpaceAvailable(JobFunc&& callback);
+    
+    // counters are kept in per-thread shards and summed up here, so the snapshot
+    // may be slightly inconsistent while jobs are moving through the queue
+    virtual QueueStats stats();
+    
+    // drops every pending job without running it, returns how many there were
+    size_t clear();
+    
 protected:
-    std::mutex& getJobsMutex();
-    bool emptyUnprotected();
+    // the low 32 bits of a job id are laid out as [local:1][priority:2][counter:29]
+    static const uint32_t JobCounterBits = 29;
+    static const uint32_t JobCounterMask = (1u << JobCounterBits) - 1;
     
-private:
-    virtual void newJobAdded();
+    // job numbers with this bit set are kept outside the shared storage by a subclass
+    static const uint32_t LocalJobBit = 0x80000000;
     
     class Job
     {
     public:
         uint64_t id = 0;
-        VoidFunc func;
+        uint32_t priority = 0;
+        int64_t enqueueTime = 0; // steady_clock ticks, only set with timeJobs
+        JobFunc func;
     };
     
+    // runs a job taken out of the queue, counting (and timing) it
+    void runJob(Job& job);
+    void countDropped(size_t count);
+    
+    std::mutex& getJobsMutex();
+    bool emptyUnprotected();
+    
+    // lock-free and possibly stale, for polling before taking the jobs mutex
+    bool emptyHint() const;
+    size_t sizeHint() const;
+    uint64_t makeJobId(uint32_t jobNumber) const;
+    uint32_t clampPriority(uint32_t priority) const;
+    
+private:
+    virtual void newJobAdded();
+    virtual void newJobsAdded(size_t count);
+    
+    // lets a subclass take a job before it reaches the shared storage, in which
+    // case it must assign the job id and return true
+    virtual bool enqueueLocal(Job& job, uint64_t& jobId);
+    
     typedef std::deque<Job> Jobs;
+    typedef Util::MPMCRingBufferT<Job> JobRing;
+    
+    // one FIFO per priority
+    struct Band
+    {
+        Jobs jobs;
+        size_t numCanceled = 0; // tombstones (jobs with an empty func) in jobs
+        uint32_t nextJobNumber = 1;
+        uint32_t skipped = 0;   // dequeues that went to a higher band while this one waited
+    };
+    
+    typedef std::vector<JobFunc> Callbacks;
+    
+    // every thread that updates a queue's counters gets a block of its own, written
+    // only by that thread with relaxed loads and stores and summed up by stats().
+    // a thread hands its blocks back when it exits, and the next thread to touch the
+    // queue carries on counting in one of them
+    struct ThreadStats
+    {
+        ThreadStats();
+        
+        std::atomic<bool> inUse;
+        std::atomic<uint64_t> numEnqueued;
+        std::atomic<uint64_t> numDequeued;
+        std::atomic<uint64_t> numCanceled;
+        std::atomic<uint64_t> numRejected;
+        std::atomic<uint64_t> numDropped;
+        std::atomic<uint64_t> waitTime[LatencyHistogram::NumBuckets];
+        std::atomic<uint64_t> runTime[LatencyHistogram::NumBuckets];
+        char padding[64];
+    };
+    
+    void init(const Options& options);
+    uint64_t enqueueJob(Job&& job, Overflow overflow);
+    uint64_t enqueueJobs(std::vector<Job>& jobs);
+    uint32_t nextJobNumberUnprotected(Band& band, uint32_t priority, uint32_t count);
+    
+    // job counters run from 1 to JobCounterMask and then start over at 1, so the low
+    // bits of a job id never read as "no job". ring positions map onto the same cycle
+    static uint32_t advanceCounter(uint32_t counter, uint32_t offset);
+    static uint32_t ringJobNumber(uint64_t pos);
+    bool popNextUnprotected(Job& job);
+    void popCanceledUnprotected(Band& band);
+    bool fullUnprotected(size_t count);
+    bool dropOldestUnprotected(Callbacks& dropped);
+    bool dropOldestFromRing();
+    void spaceFreedUnprotected(size_t count, Callbacks& callbacks);
+    void spaceFreedInRing();
+    ThreadStats& threadStats();
+    static void increment(std::atomic<uint64_t>& counter, uint64_t count);
     
     uint32_t m_queueId;
     std::mutex m_jobsMutex;
-    uint32_t m_nextJobNumber = 1;
-    Jobs m_jobs;
+    std::vector<Band> m_bands;
+    uint32_t m_agingLimit = 0;
+    std::atomic<size_t> m_numQueued{0}; // live jobs in m_bands, written under the jobs mutex
+    std::unique_ptr<JobRing> m_ring;
+    
+    // bounded queues, everything but m_numSpaceWaiters is guarded by the jobs mutex
+    size_t m_maxJobs = 0;
+    Overflow m_overflow = Overflow::Block;
+    std::condition_variable m_spaceCond;
+    uint32_t m_numBlocked = 0;     // producers waiting on m_spaceCond
+    uint32_t m_numBlockedBulk = 0; // the bulk ones among them, which need more than one slot
+    std::deque<JobFunc> m_spaceWaiters;
+    std::atomic<size_t> m_numSpaceWaiters{0};
+    
+    bool m_timeJobs = false;
+    uint64_t m_statsId = 0; // never reused, keys each thread's lookup of its block
+    std::mutex m_statsMutex;
+    std::vector<std::shared_ptr<ThreadStats>> m_threadStats;
+    size_t m_peakDepth = 0; // guarded by the jobs mutex
 };
 
-void registerQueue(Queue::Ptr q);
+class QueueRef;
+
+// returns a direct handle to q, or a null handle if its id was already taken
+QueueRef registerQueue(Queue::Ptr q);
 bool unregisterQueue(uint32_t queueId);
+Queue::Ptr getQueue(uint32_t queueId);
+
+uint64_t enqueue(uint32_t queueId, JobFunc&& func, uint32_t priority = 0);
 
 template <typename F>
-uint64_t enqueue(uint32_t queueId, const F& func)
+uint64_t enqueue(uint32_t queueId, F&& func, uint32_t priority = 0)
 {
-    VoidFunc vf = [func]() {
-        func();
-    };
-    return enqueue(queueId, vf);
+    return enqueue(queueId, JobFunc(std::forward<F>(func)), priority);
 }
 
-template <>
-uint64_t enqueue<VoidFunc>(uint32_t queueId, const VoidFunc& func);
+template <typename F>
+uint64_t tryEnqueue(uint32_t queueId, F&& func, uint32_t priority = 0)
+{
+    Queue::Ptr q = getQueue(queueId);
+    if (!q)
+        return 0;
+    
+    return q->tryEnqueue(std::forward<F>(func), priority);
+}
+
+template <typename Iter>
+uint64_t enqueueBulk(uint32_t queueId, Iter first, Iter last, uint32_t priority = 0)
+{
+    Queue::Ptr q = getQueue(queueId);
+    if (!q)
+        return 0;
+    
+    return q->enqueueBulk(first, last, priority);
+}
 
 bool cancel(uint64_t jobId);
 
+// snapshots of every registered queue, ordered by queue id
+std::vector<QueueStats> allQueueStats();
+
+// A cheap, copyable handle to a queue. The handles returned by registerQueue()
+// point straight at the queue, so enqueueing through them needs neither a registry
+// lookup nor a Queue::Ptr copy. Like a raw pointer, such a handle must not be used
+// once its queue has been unregistered.
+//
+// A handle made from a plain queue id resolves the id through the registry on every
+// call, which keeps all id based call sites working unchanged.
+class QueueRef
+{
+public:
+    QueueRef()
+    {
+    }
+    
+    QueueRef(uint32_t queueId)
+        : m_queueId(queueId)
+    {
+    }
+    
+    uint32_t getId() const
+    {
+        return m_queueId;
+    }
+    
+    bool isDirect() const
+    {
+        return m_queue != nullptr;
+    }
+    
+    explicit operator bool() const
+    {
+        return m_queue != nullptr || m_queueId != 0;
+    }
+    
+    template <typename F>
+    uint64_t enqueue(F&& func, uint32_t priority = 0) const
+    {
+        if (m_queue)
+            return m_queue->enqueue(std::forward<F>(func), priority);
+        
+        return Async::enqueue(m_queueId, std::forward<F>(func), priority);
+    }
+    
+    template <typename F>
+    uint64_t tryEnqueue(F&& func, uint32_t priority = 0) const
+    {
+        if (m_queue)
+            return m_queue->tryEnqueue(std::forward<F>(func), priority);
+        
+        return Async::tryEnqueue(m_queueId, std::forward<F>(func), priority);
+    }
+    
+    template <typename Iter>
+    uint64_t enqueueBulk(Iter first, Iter last, uint32_t priority = 0) const
+    {
+        if (m_queue)
+            return m_queue->enqueueBulk(first, last, priority);
+        
+        return Async::enqueueBulk(m_queueId, first, last, priority);
+    }
+    
+    bool cancel(uint64_t jobId) const
+    {
+        // job ids of other queues (timers) still go through Async::cancel
+        if (m_queue && (jobId >> 32) == m_queueId)
+            return m_queue->cancel(jobId);
+        
+        return Async::cancel(jobId);
+    }
+    
+private:
+    friend QueueRef registerQueue(Queue::Ptr q);
+    
+    QueueRef(Queue* queue, uint32_t queueId)
+        : m_queue(queue)
+        , m_queueId(queueId)
+    {
+    }
+    
+    Queue* m_queue = nullptr;
+    uint32_t m_queueId = 0;
+};
+
 class ThreadPoolQueue
     : public Queue
 {
@@ -98,20 +388,280 @@ public:
     typedef std::shared_ptr<ThreadPoolQueue> Ptr;
     typedef std::weak_ptr<ThreadPoolQueue> WeakPtr;
     
+    enum class Placement
+    {
+        None,       // workers float freely
+        Cores,      // worker i is pinned to cpus[i % cpus.size()]
+        CpuSet,     // every worker may run on any of cpus
+        NumaNode,   // every worker may run on any cpu of numaNode
+        NumaSpread  // worker i may run on any cpu of node i % getNumNumaNodes()
+    };
+    
+    struct Options
+        : public Queue::Options
+    {
+        // where worker threads run. an empty cpus list means all available cpus,
+        // pinning failures (or platforms without affinity support) are ignored
+        Placement placement = Placement::None;
+        Async::CpuSet cpus;
+        uint32_t numaNode = 0;
+        
+        // jobs enqueued from one of this queue's workers go to that worker's own
+        // deque, idle workers steal from the other workers' deques.
+        // jobs on a worker deque can't be canceled through Queue::cancel,
+        // only priority 0 jobs are kept on worker deques
+        bool workStealing = false;
+        
+        // an idle worker polls for new jobs spinCount times (with a cpu pause),
+        // then yieldCount times (yielding its time slice) before it parks on the
+        // condition variable. spinning trades cpu time for wakeup latency, parked
+        // workers cost producers a futex wake while the rest cost them nothing
+        uint32_t spinCount = 0;
+        uint32_t yieldCount = 0;
+        
+        // elastic mode, enabled by a maxThreads above numThreads. the pool starts
+        // with numThreads workers and spawns more (up to maxThreads) when a job is
+        // enqueued while no worker is parked and either spawnQueueDepth jobs are
+        // waiting or no worker has been idle for spawnWaitTime (so the oldest job
+        // may have waited that long). workers parked for keepAlive retire until
+        // the pool is back to numThreads. ignored with workStealing, whose thieves
+        // need a fixed worker list, so such a pool keeps numThreads workers
+        uint32_t maxThreads = 0;
+        size_t spawnQueueDepth = 64;
+        std::chrono::milliseconds spawnWaitTime{10};
+        std::chrono::milliseconds keepAlive{5000};
+    };
+    
     ThreadPoolQueue(uint32_t numThreads);
     ThreadPoolQueue(uint32_t queueId, uint32_t numThreads);
+    ThreadPoolQueue(uint32_t queueId, uint32_t numThreads, const Options& options);
     ~ThreadPoolQueue();
     
+    struct ShutdownReport
+    {
+        size_t numLeft = 0; // jobs dropped without running
+        std::chrono::steady_clock::duration drainTime{0};  // waiting for queued work to finish
+        std::chrono::steady_clock::duration cancelTime{0}; // dropping what was left
+        std::chrono::steady_clock::duration joinTime{0};   // waiting for running jobs and threads
+    };
+    
+    // stops the workers once running jobs finish. queued jobs stay in the queue
     void stop();
     
+    // lets the workers finish queued work (including jobs it enqueues) until the
+    // pool is idle or deadline passes, then shuts down like shutdownNow()
+    ShutdownReport drain(std::chrono::steady_clock::time_point deadline);
+    
+    // drops all queued jobs and stops the workers once running jobs finish.
+    // tasks whose jobs are dropped are canceled, which wakes their waiters
+    ShutdownReport shutdownNow();
+    
+    // true on the worker threads of any pool
+    static bool isWorkerThread();
+    
+    // runs one pending job (own deque, shared queue or stolen) of the calling
+    // worker's pool, so a worker about to block can help instead. returns false
+    // when not called on a worker or when nothing was pending
+    static bool helpOnCurrentWorker();
+    
+    uint32_t getNumThreads() const;
+    uint64_t getNumSpawned() const; // elastic spawns, not counting the initial workers
+    uint64_t getNumRetired() const;
+    
+    // adds busy and idle times of the current workers
+    virtual QueueStats stats() override;
+    
+private:
+    struct Worker;
+    
+    // local jobs live in slabs owned by the worker that pushed them, so a local
+    // enqueue doesn't allocate. see allocateSlot() and releaseSlot()
+    struct JobSlot
+    {
+        Job job;
+        Worker* owner = nullptr;
+        JobSlot* nextFree = nullptr;
+    };
+    
+    static const size_t SlotsPerSlab = 64;
+    
+    struct Worker
+    {
+        ThreadPoolQueue* queue = nullptr;
+        uint32_t index = 0;
+        uint32_t rng = 0;
+        Async::CpuSet cpus; // empty when unpinned
+        std::atomic<bool> busy{true}; // false while polling or parked
+        
+        // steady_clock ticks. idleSince is 0 while busy
+        std::atomic<int64_t> started{0};
+        std::atomic<int64_t> idleTime{0};
+        std::atomic<int64_t> idleSince{0};
+        Util::WorkStealingDequeT<JobSlot*> jobs;
+        std::thread thread;
+        
+        // the owner recycles slots through freeSlots, thieves hand theirs back
+        // through remoteFreeSlots, which the owner takes over once freeSlots runs out
+        JobSlot* freeSlots = nullptr;
+        std::atomic<JobSlot*> remoteFreeSlots{nullptr};
+        std::vector<std::unique_ptr<JobSlot[]>> slabs;
+    };
+    
+    typedef std::chrono::steady_clock Clock;
+    
+    void init(uint32_t numThreads, const Options& options);
+    size_t stopWorkers();
+    void finishShutdown(ShutdownReport& report);
+    bool isIdle();
+    void run(Worker* worker);
+    bool runNextForWorker(Worker* worker);
+    bool steal(Worker* thief);
+    JobSlot* allocateSlot(Worker* worker);
+    void releaseSlot(JobSlot* slot);
+    bool hasWorkUnprotected();
+    bool pollForWork();
+    bool park();
+    void markIdle();
+    void maybeSpawnWorker();
+    void startWorker();
+    Async::CpuSet workerCpus(uint32_t index) const;
+    void retireWorker(Worker* worker);
+    virtual void newJobAdded() override;
+    virtual void newJobsAdded(size_t count) override;
+    virtual bool enqueueLocal(Job& job, uint64_t& jobId) override;
+    
+    static thread_local Worker* s_currentWorker;
+    
+    std::atomic<bool> m_running{true};
+    bool m_workStealing = false;
+    Placement m_placement = Placement::None;
+    std::vector<Async::CpuSet> m_cpuGroups; // per placement group, see workerCpus()
+    uint32_t m_spinCount = 0;
+    uint32_t m_yieldCount = 0;
+    std::atomic<uint32_t> m_nextLocalJobNumber{0};
+    std::atomic<uint32_t> m_sleepers{0};
+    std::condition_variable m_cond;
+    
+    // elastic mode
+    bool m_elastic = false;
+    uint32_t m_minThreads = 0;
+    uint32_t m_maxThreads = 0;
+    size_t m_spawnQueueDepth = 0;
+    std::chrono::steady_clock::duration m_spawnWaitTime;
+    std::chrono::steady_clock::duration m_keepAlive;
+    std::atomic<int64_t> m_lastIdle{0}; // steady_clock ticks
+    std::atomic<bool> m_spawning{false};
+    std::atomic<uint32_t> m_numThreads{0};
+    std::atomic<uint64_t> m_numSpawned{0};
+    std::atomic<uint64_t> m_numRetired{0};
+    
+    // the worker list only changes in elastic mode (under m_workersMutex). retired
+    // workers wait in m_retired until their thread can be joined
+    std::mutex m_workersMutex;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::vector<std::unique_ptr<Worker>> m_retired;
+    
+    // work stealing mode: every worker, fixed from init() until the workers are
+    // stopped, so thieves scan it without locking
+    std::vector<Worker*> m_victims;
+};
+
+// Creates, registers and returns one pool per NUMA node, with threadsPerNode workers
+// confined to that node. The pool for node n gets queue id firstQueueId + n, so work
+// can be targeted at the node that owns its data.
+std::vector<ThreadPoolQueue::Ptr> createNumaQueues(uint32_t firstQueueId, uint32_t threadsPerNode, const ThreadPoolQueue::Options& options = ThreadPoolQueue::Options());
+
+// A serial queue runs its jobs one at a time in FIFO (per band) order without owning
+// any threads. Whenever it becomes non-empty it enqueues a single drain job on its
+// target queue, which runs up to maxJobsPerDrain jobs and then re-enqueues itself
+// if more are pending, so thousands of serial queues can share one pool.
+//
+// A pending drain job holds a reference to the serial queue, so it must be owned by
+// a shared_ptr (std::make_shared) before jobs are enqueued on it. A drain job the
+// target refuses while full is retried once the target has room; one refused or
+// dropped otherwise is replaced by the next enqueue.
+class SerialQueue
+    : public Queue
+{
+public:
+    typedef std::shared_ptr<SerialQueue> Ptr;
+    typedef std::weak_ptr<SerialQueue> WeakPtr;
+    
+    struct Options
+        : public Queue::Options
+    {
+        // bounds how long one serial queue can hold on to a target worker
+        uint32_t maxJobsPerDrain = 64;
+        
+        // priority of the drain jobs on the target queue
+        uint32_t targetPriority = 0;
+    };
+    
+    SerialQueue(Queue::Ptr target);
+    SerialQueue(uint32_t queueId, Queue::Ptr target);
+    SerialQueue(uint32_t queueId, Queue::Ptr target, const Options& options);
+    
+    Queue::Ptr getTarget() const;
+    
 private:
-    void init(uint32_t numThreads);
-    void run();
+    class DrainJob;
+    
+    void init(const Options& options);
+    void scheduleDrain();
+    void drain();
+    void drainDropped();
+    virtual void newJobAdded() override;
+    virtual void newJobsAdded(size_t count) override;
+    
+    Queue::Ptr m_target;
+    uint32_t m_maxJobsPerDrain = 64;
+    uint32_t m_targetPriority = 0;
+    std::atomic<bool> m_scheduled{false};
+};
+
+// A run loop queue owns no threads: its jobs run on whichever thread pumps it, typically
+// the main thread or an existing event loop. Register it and other threads can marshal
+// work back to that thread, e.g. Task::then(mainQueueId, ...). Between jobs the pumping
+// thread parks on a condition variable and is woken by the next enqueue.
+//
+// Only one thread should pump a run loop queue at a time.
+class RunLoopQueue
+    : public Queue
+{
+public:
+    typedef std::shared_ptr<RunLoopQueue> Ptr;
+    typedef std::weak_ptr<RunLoopQueue> WeakPtr;
+    
+    RunLoopQueue();
+    RunLoopQueue(uint32_t queueId);
+    RunLoopQueue(uint32_t queueId, const Options& options);
+    
+    // runs the jobs that are pending at the time of the call, but none they enqueue,
+    // and returns the number of jobs run. never parks
+    size_t runAllPending();
+    
+    // runs jobs as they arrive until the duration has elapsed
+    size_t runFor(std::chrono::steady_clock::duration duration);
+    
+    // runs jobs as they arrive until done() returns true. done() is checked before
+    // each job and whenever the parked thread wakes, so if it depends on state that
+    // is not changed by a job, call wakeUp() after changing it
+    size_t runUntil(const std::function<bool()>& done);
+    
+    // wakes the pumping thread, if parked, to re-check its stop condition
+    void wakeUp();
+    
+private:
+    typedef std::chrono::steady_clock Clock;
+    
+    size_t run(const std::function<bool()>& done, Clock::time_point deadline);
+    void park(Clock::time_point deadline);
     virtual void newJobAdded() override;
+    virtual void newJobsAdded(size_t count) override;
     
-    bool m_running = true;
+    std::atomic<bool> m_parked{false};
+    bool m_wakeUp = false; // guarded by the jobs mutex
     std::condition_variable m_cond;
-    std::vector<std::thread> m_threads;
 };
 
 
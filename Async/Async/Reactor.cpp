@@ -0,0 +1,351 @@
+#include "Async/Reactor.h"
+
+#include <cassert>
+#include <cerrno>
+
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+#include <sys/event.h>
+#endif
+
+ASYNC_BEGIN
+
+namespace
+{
+    const int MaxEventsPerWait = 64;
+}
+
+////////// Reactor
+
+Reactor::Reactor()
+{
+    // without a poller every watch() returns 0, so waiters fall back to treating
+    // their descriptors as ready instead of waiting forever
+    m_opened = openPoller();
+    if (m_opened)
+        m_thread = std::thread(&Reactor::run, this);
+}
+
+Reactor::~Reactor()
+{
+    // watches that have not fired are dropped along with their callbacks
+    if (m_thread.joinable())
+    {
+        m_running = false;
+        wake();
+        m_thread.join();
+    }
+    closePoller();
+}
+
+Reactor&
+Reactor::getDefault()
+{
+    static Reactor reactor;
+    return reactor;
+}
+
+uint64_t
+Reactor::watch(int fd, uint32_t events, JobFunc&& func)
+{
+    assert(func);
+    assert((events & (Readable | Writable)) != 0);
+    if (!m_opened)
+        return 0;
+    
+    // the registration is refreshed even when the interest doesn't change. the
+    // descriptor may have been closed (dropping the kernel's registration) and its
+    // number reused while stale watches kept our entry alive
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Descriptor& descriptor = m_descriptors[fd];
+    uint32_t newEvents = descriptor.events | events;
+    if (!setInterest(fd, descriptor.events, newEvents))
+    {
+        if (descriptor.watches.empty())
+            m_descriptors.erase(fd);
+        return 0;
+    }
+    descriptor.events = newEvents;
+    
+    Watch watch;
+    watch.id = ++m_nextWatchId;
+    watch.events = events;
+    watch.func = std::move(func);
+    descriptor.watches.push_back(std::move(watch));
+    m_watchFds[m_nextWatchId] = fd;
+    return m_nextWatchId;
+}
+
+bool
+Reactor::cancel(uint64_t watchId)
+{
+    JobFunc func;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_watchFds.find(watchId);
+        if (it == m_watchFds.end())
+            return false;
+        
+        int fd = it->second;
+        m_watchFds.erase(it);
+        Descriptor& descriptor = m_descriptors[fd];
+        for (auto w = descriptor.watches.begin(); w != descriptor.watches.end(); ++w)
+        {
+            if (w->id == watchId)
+            {
+                func = std::move(w->func);
+                descriptor.watches.erase(w);
+                break;
+            }
+        }
+        updateInterest(fd, descriptor);
+    }
+    
+    // the callback (and whatever it captured) is destroyed after unlocking
+    return true;
+}
+
+size_t
+Reactor::numWatches()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_watchFds.size();
+}
+
+void
+Reactor::run()
+{
+    ReadyList ready;
+    while (m_running)
+    {
+        ready.clear();
+        waitForEvents(ready);
+        dispatch(ready);
+    }
+}
+
+void
+Reactor::dispatch(const ReadyList& ready)
+{
+    std::vector<JobFunc> fired;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (const auto& event : ready)
+        {
+            auto it = m_descriptors.find(event.first);
+            if (it == m_descriptors.end())
+                continue;
+            
+            Descriptor& descriptor = it->second;
+            for (auto w = descriptor.watches.begin(); w != descriptor.watches.end(); )
+            {
+                if ((w->events & event.second) == 0)
+                {
+                    ++w;
+                    continue;
+                }
+                
+                fired.push_back(std::move(w->func));
+                m_watchFds.erase(w->id);
+                w = descriptor.watches.erase(w);
+            }
+            updateInterest(event.first, descriptor);
+        }
+    }
+    
+    // outside the lock, so callbacks can add new watches
+    for (auto& func : fired)
+        func();
+}
+
+void
+Reactor::updateInterest(int fd, Descriptor& descriptor)
+{
+    // narrows the registration to what the remaining watches need, the poller is
+    // level-triggered and would otherwise keep reporting the same readiness
+    uint32_t events = 0;
+    for (const Watch& watch : descriptor.watches)
+        events |= watch.events;
+    
+    if (events != descriptor.events)
+    {
+        setInterest(fd, descriptor.events, events);
+        descriptor.events = events;
+    }
+    
+    if (descriptor.watches.empty())
+        m_descriptors.erase(fd);
+}
+
+#if defined(__linux__)
+
+////////// Reactor (epoll)
+
+bool
+Reactor::openPoller()
+{
+    m_pollFd = epoll_create1(EPOLL_CLOEXEC);
+    m_wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_pollFd < 0 || m_wakeFd < 0)
+        return false;
+    
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = m_wakeFd;
+    return epoll_ctl(m_pollFd, EPOLL_CTL_ADD, m_wakeFd, &event) == 0;
+}
+
+void
+Reactor::closePoller()
+{
+    if (m_wakeFd >= 0)
+        close(m_wakeFd);
+    if (m_pollFd >= 0)
+        close(m_pollFd);
+}
+
+bool
+Reactor::setInterest(int fd, uint32_t oldEvents, uint32_t newEvents)
+{
+    if (newEvents == 0)
+    {
+        // fails harmlessly if the descriptor was closed while watched
+        epoll_ctl(m_pollFd, EPOLL_CTL_DEL, fd, nullptr);
+        return true;
+    }
+    
+    epoll_event event = {};
+    event.events = 0;
+    if (newEvents & Readable)
+        event.events |= EPOLLIN | EPOLLRDHUP;
+    if (newEvents & Writable)
+        event.events |= EPOLLOUT;
+    event.data.fd = fd;
+    if (oldEvents != 0 && epoll_ctl(m_pollFd, EPOLL_CTL_MOD, fd, &event) == 0)
+        return true;
+    
+    // closing a descriptor drops its registration, so a reused descriptor number
+    // we still know about may need adding again
+    return epoll_ctl(m_pollFd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+void
+Reactor::waitForEvents(ReadyList& ready)
+{
+    epoll_event events[MaxEventsPerWait];
+    int count = epoll_wait(m_pollFd, events, MaxEventsPerWait, -1);
+    for (int i=0; i<count; i++)
+    {
+        int fd = events[i].data.fd;
+        if (fd == m_wakeFd)
+        {
+            uint64_t value = 0;
+            ssize_t result = read(m_wakeFd, &value, sizeof(value));
+            static_cast<void>(result);
+            continue;
+        }
+        
+        // errors and hang-ups complete both directions, the next read or write reports them
+        uint32_t flags = events[i].events;
+        uint32_t readyEvents = 0;
+        if (flags & (EPOLLIN | EPOLLPRI | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            readyEvents |= Readable;
+        if (flags & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            readyEvents |= Writable;
+        ready.push_back(std::make_pair(fd, readyEvents));
+    }
+}
+
+void
+Reactor::wake()
+{
+    uint64_t value = 1;
+    ssize_t result = write(m_wakeFd, &value, sizeof(value));
+    static_cast<void>(result);
+}
+
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+
+////////// Reactor (kqueue)
+
+bool
+Reactor::openPoller()
+{
+    m_pollFd = kqueue();
+    if (m_pollFd < 0)
+        return false;
+    
+    // a user event on ident 0 wakes the reactor thread
+    struct kevent change;
+    EV_SET(&change, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+    return kevent(m_pollFd, &change, 1, nullptr, 0, nullptr) == 0;
+}
+
+void
+Reactor::closePoller()
+{
+    if (m_pollFd >= 0)
+        close(m_pollFd);
+}
+
+bool
+Reactor::setInterest(int fd, uint32_t oldEvents, uint32_t newEvents)
+{
+    // kqueue keeps a separate registration per filter. EV_ADD of a registered filter
+    // just updates it, so wanted filters are always added, which also restores them
+    // after the descriptor was closed and its number reused
+    struct kevent removals[2];
+    struct kevent additions[2];
+    int numRemovals = 0;
+    int numAdditions = 0;
+    const uint32_t directions[2] = { Readable, Writable };
+    const int16_t filters[2] = { EVFILT_READ, EVFILT_WRITE };
+    for (int i=0; i<2; i++)
+    {
+        if (newEvents & directions[i])
+            EV_SET(&additions[numAdditions++], fd, filters[i], EV_ADD, 0, 0, nullptr);
+        else if (oldEvents & directions[i])
+            EV_SET(&removals[numRemovals++], fd, filters[i], EV_DELETE, 0, 0, nullptr);
+    }
+    
+    // deleting fails harmlessly if the descriptor was closed while watched
+    if (numRemovals > 0)
+        kevent(m_pollFd, removals, numRemovals, nullptr, 0, nullptr);
+    return numAdditions == 0 || kevent(m_pollFd, additions, numAdditions, nullptr, 0, nullptr) == 0;
+}
+
+void
+Reactor::waitForEvents(ReadyList& ready)
+{
+    struct kevent events[MaxEventsPerWait];
+    int count = kevent(m_pollFd, nullptr, 0, events, MaxEventsPerWait, nullptr);
+    for (int i=0; i<count; i++)
+    {
+        if (events[i].filter == EVFILT_USER)
+            continue;
+        
+        // errors complete both directions, the next read or write reports them
+        uint32_t readyEvents = (events[i].filter == EVFILT_READ) ? Readable : Writable;
+        if (events[i].flags & EV_ERROR)
+            readyEvents = Readable | Writable;
+        ready.push_back(std::make_pair(static_cast<int>(events[i].ident), readyEvents));
+    }
+}
+
+void
+Reactor::wake()
+{
+    struct kevent change;
+    EV_SET(&change, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, nullptr);
+    kevent(m_pollFd, &change, 1, nullptr, 0, nullptr);
+}
+
+#else
+#error "Async::Reactor needs epoll or kqueue"
+#endif
+
+ASYNC_END
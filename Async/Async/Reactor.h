@@ -0,0 +1,89 @@
+#pragma once
+
+#include "Async/Base.h"
+#include "Async/JobFunc.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+ASYNC_BEGIN
+
+// A reactor watches file descriptors for I/O readiness with its own epoll (kqueue on
+// Apple platforms) descriptor and a single thread waiting on it. Watches are one-shot:
+// the callback runs once, on the reactor thread, when the descriptor becomes ready
+// or reports an error or hang-up, so it should only hand work off, e.g. by enqueueing
+// a job. Tasks wait for readiness with Async::whenReadable() and whenWritable().
+class Reactor
+{
+public:
+    enum Events : uint32_t
+    {
+        Readable = 1,
+        Writable = 2,
+    };
+    
+    Reactor();
+    ~Reactor();
+    
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+    
+    // the reactor behind whenReadable() and whenWritable(), started on first use
+    static Reactor& getDefault();
+    
+    // returns the watch id, or 0 without calling func if the descriptor cannot be
+    // watched (a bad descriptor, a regular file with epoll, which is always ready, or
+    // a reactor whose poller could not be created). cancel pending watches before
+    // closing their descriptor
+    uint64_t watch(int fd, uint32_t events, JobFunc&& func);
+    
+    // returns false if the watch has already fired or been canceled
+    bool cancel(uint64_t watchId);
+    
+    size_t numWatches();
+    
+private:
+    struct Watch
+    {
+        uint64_t id = 0;
+        uint32_t events = 0;
+        JobFunc func;
+    };
+    
+    // all watches on one descriptor share a single registration with the poller
+    struct Descriptor
+    {
+        uint32_t events = 0; // registered interest, the union of the watches' events
+        std::vector<Watch> watches;
+    };
+    
+    typedef std::vector<std::pair<int, uint32_t>> ReadyList;
+    
+    void run();
+    void dispatch(const ReadyList& ready);
+    void updateInterest(int fd, Descriptor& descriptor);
+    
+    // poller backend, see the platform sections in Reactor.cpp
+    bool openPoller();
+    void closePoller();
+    bool setInterest(int fd, uint32_t oldEvents, uint32_t newEvents);
+    void waitForEvents(ReadyList& ready);
+    void wake();
+    
+    int m_pollFd = -1;
+    int m_wakeFd = -1;
+    bool m_opened = false;
+    std::atomic<bool> m_running{true};
+    std::thread m_thread;
+    
+    std::mutex m_mutex;
+    uint64_t m_nextWatchId = 0;
+    std::unordered_map<int, Descriptor> m_descriptors;
+    std::unordered_map<uint64_t, int> m_watchFds;
+};
+
+ASYNC_END
@@ -0,0 +1,58 @@
+#include "Async/Stats.h"
+
+#include <algorithm>
+
+ASYNC_BEGIN
+
+size_t
+LatencyHistogram::bucketFor(std::chrono::steady_clock::duration d)
+{
+    int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    size_t bucket = 0;
+    while (us > 0 && bucket < NumBuckets - 1)
+    {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+uint64_t
+LatencyHistogram::count() const
+{
+    uint64_t total = 0;
+    for (size_t i=0; i<NumBuckets; i++)
+        total += buckets[i];
+    return total;
+}
+
+std::chrono::microseconds
+LatencyHistogram::percentile(double q) const
+{
+    uint64_t total = count();
+    if (total == 0)
+        return std::chrono::microseconds(0);
+    
+    // rank of the sample we are after, 1 based
+    uint64_t rank = static_cast<uint64_t>(q * total + 0.5);
+    rank = std::max<uint64_t>(1, std::min(rank, total));
+    
+    uint64_t seen = 0;
+    for (size_t i=0; i<NumBuckets; i++)
+    {
+        seen += buckets[i];
+        if (seen >= rank)
+            return std::chrono::microseconds(1ll << i);
+    }
+    return std::chrono::microseconds(1ll << (NumBuckets - 1));
+}
+
+LatencyHistogram&
+LatencyHistogram::operator+=(const LatencyHistogram& other)
+{
+    for (size_t i=0; i<NumBuckets; i++)
+        buckets[i] += other.buckets[i];
+    return *this;
+}
+
+ASYNC_END
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "Async/Base.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+ASYNC_BEGIN
+
+// Log2 histogram of durations in microseconds. Bucket 0 counts durations below
+// 1us, bucket i (i > 0) those in [2^(i-1), 2^i) us and the last bucket everything
+// longer than that.
+struct LatencyHistogram
+{
+    static const size_t NumBuckets = 32;
+    
+    static size_t bucketFor(std::chrono::steady_clock::duration d);
+    
+    uint64_t count() const;
+    
+    // upper bound of the bucket that holds quantile q (0 ... 1), 0 when empty
+    std::chrono::microseconds percentile(double q) const;
+    
+    LatencyHistogram& operator+=(const LatencyHistogram& other);
+    
+    uint64_t buckets[NumBuckets] = {};
+};
+
+struct WorkerStats
+{
+    std::chrono::steady_clock::duration busyTime{0}; // since the worker started
+    std::chrono::steady_clock::duration idleTime{0}; // polling or parked
+};
+
+// A snapshot taken by Queue::stats(). Counters are totals since the queue was
+// created, depths count the jobs in the queue's shared storage.
+struct QueueStats
+{
+    uint32_t queueId = 0;
+    uint64_t numEnqueued = 0;
+    uint64_t numDequeued = 0; // taken out to run
+    uint64_t numCanceled = 0;
+    uint64_t numRejected = 0; // refused by a full queue (Fail, RunOnCaller, tryEnqueue)
+    uint64_t numDropped = 0;  // discarded by DropOldest, clear() or a pool shutdown
+    size_t depth = 0;
+    size_t peakDepth = 0; // ring buffers only sample it when stats are taken
+    
+    // ThreadPoolQueue only, one entry per current worker
+    std::vector<WorkerStats> workers;
+    
+    // only collected when the queue was created with Options::timeJobs
+    LatencyHistogram waitTime; // from enqueue until the job starts
+    LatencyHistogram runTime;
+};
+
+ASYNC_END
@@ -1,11 +1,18 @@
 #pragma once
 
+#include "Async/Hooks.h"
 #include "Async/Queue.h"
+#include "Async/Reactor.h"
+#include "Async/Trace.h"
 #include "Util/StateMachineT.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <future>
+#include <iterator>
+#include <vector>
 
 ASYNC_BEGIN
 
@@ -22,6 +29,10 @@ namespace Details
         virtual bool schedule() = 0;
         virtual bool cancel() = 0;
     };
+    
+    // see Async/Coroutine.h
+    template <typename T>
+    class CoroutinePromiseBase;
 }
 
 template <typename T>
@@ -30,23 +41,127 @@ class Task
 public:
     typedef std::function<void(Task<T>)> CompletionFunc;
     
+    // queue may be a plain queue id or a direct handle from registerQueue()
     template <typename F>
-    Task(uint32_t queueId, const F& f)
+    Task(QueueRef queue, const F& f, uint32_t priority = 0)
     {
-        m_work = std::make_shared<Work>(queueId, f);
+        m_work = std::make_shared<Work>(queue, f, priority);
         m_work->schedule();
     }
     
+    // creates count tasks running f(0) ... f(count - 1), all of which are
+    // submitted to the queue with a single bulk enqueue
+    template <typename F>
+    static std::vector<Task<T>> createBatch(QueueRef queue, size_t count, const F& f, uint32_t priority = 0)
+    {
+        std::vector<Task<T>> tasks;
+        std::vector<typename Work::Ptr> scheduled;
+        std::vector<JobFunc> jobs;
+        tasks.reserve(count);
+        scheduled.reserve(count);
+        jobs.reserve(count);
+        
+        for (size_t i=0; i<count; i++)
+        {
+            auto g = [f, i]() {
+                return f(i);
+            };
+            
+            typename Work::Ptr work = std::make_shared<Work>(queue, g, priority);
+            if (work->scheduleBatch(jobs))
+                scheduled.push_back(work);
+            tasks.push_back(Task<T>(work));
+        }
+        
+        uint64_t firstJobId = queue.enqueueBulk(std::make_move_iterator(jobs.begin()), std::make_move_iterator(jobs.end()), priority);
+        if (firstJobId != 0)
+        {
+            for (size_t i=0; i<scheduled.size(); i++)
+                scheduled[i]->setJobId(Queue::offsetJobId(firstJobId, static_cast<uint32_t>(i)));
+        }
+        
+        return tasks;
+    }
+    
+    // creates a task that runs f on queue once target has room for another job,
+    // so a producer feeding a bounded queue from a task can continue from it
+    // instead of blocking a thread
+    template <typename F>
+    static Task<T> whenSpaceAvailable(Queue& target, QueueRef queue, const F& f, uint32_t priority = 0)
+    {
+        typename Work::Ptr work = std::make_shared<Work>(queue, f, priority);
+        target.notifyWhenSpaceAvailable([work]() {
+            work->schedule();
+        });
+        return Task<T>(work);
+    }
+    
+    // creates a task that runs f on queue once reactor reports fd ready for events
+    // (Reactor::Readable and/or Writable). descriptors the reactor cannot watch are
+    // treated as always ready. canceling the task also cancels the watch, which
+    // must be done before closing fd
+    template <typename F>
+    static Task<T> whenReady(Reactor& reactor, int fd, uint32_t events, QueueRef queue, const F& f, uint32_t priority = 0)
+    {
+        typename Work::Ptr work = std::make_shared<Work>(queue, f, priority);
+        uint64_t watchId = reactor.watch(fd, events, [work]() {
+            work->schedule();
+        });
+        if (watchId == 0)
+            work->schedule();
+        else
+            work->setWatch(reactor, watchId);
+        return Task<T>(work);
+    }
+    
+    // creates a task that runs f on queue once signaled. start is called right away
+    // with the signal, a std::function<void()> to be called once from any thread
+    template <typename F, typename Start>
+    static Task<T> whenSignaled(QueueRef queue, const F& f, uint32_t priority, const Start& start)
+    {
+        typename Work::Ptr work = std::make_shared<Work>(queue, f, priority);
+        start(std::function<void()>([work]() {
+            work->schedule();
+        }));
+        return Task<T>(work);
+    }
+    
+    // creates a task that never runs on a queue. start is called right away with
+    // resolve, which completes the task in place with the given value on the calling
+    // thread and returns false if the task was canceled first. callers must make sure
+    // resolve is called only once
+    template <typename Start>
+    static Task<T> whenResolved(QueueRef queue, uint32_t priority, const Start& start)
+    {
+        typename Work::Ptr work = std::make_shared<Work>(queue, priority);
+        start(std::function<bool(const T&)>([work](const T& value) {
+            return work->complete([&value](std::promise<T>& promise) {
+                promise.set_value(value);
+            });
+        }));
+        return Task<T>(work);
+    }
+
     uint32_t getQueueId() const
     {
         return m_work->getQueueId();
     }
     
+    QueueRef getQueue() const
+    {
+        return m_work->getQueue();
+    }
+    
     uint64_t getJobId() const
     {
         return m_work->getJobId();
     }
     
+    uint32_t getPriority() const
+    {
+        return m_work->getPriority();
+    }
+    
     uint32_t addCompletionHandler(const CompletionFunc& handler)
     {
         Task<T> thisCopy = *this;
@@ -73,12 +188,14 @@ public:
     T get() const
     {
         // if the task has been canceled, this should probably throw an exception
+        helpWhileWaiting();
         return m_work->getFuture().get();
     }
 
     void wait() const
     {
         // if the task has been canceled, this should probably throw an exception
+        helpWhileWaiting();
         return m_work->getFuture().wait();
     }
     
@@ -91,12 +208,18 @@ public:
     template <typename Func>
     auto then(const Func& f) -> Task<decltype(f(*reinterpret_cast<T*>(0)))>
     {
-        uint32_t queueId = m_work->getQueueId();
-        return then(queueId, f);
+        return then(m_work->getQueue(), f);
+    }
+    
+    // continuations inherit this task's priority unless given their own
+    template <typename Func>
+    auto then(QueueRef queue, const Func& f) -> Task<decltype(f(*reinterpret_cast<T*>(0)))>
+    {
+        return then(queue, f, m_work->getPriority());
     }
     
     template <typename Func>
-    auto then(uint32_t queueId, const Func& f) -> Task<decltype(f(*reinterpret_cast<T*>(0)))>
+    auto then(QueueRef queue, const Func& f, uint32_t priority) -> Task<decltype(f(*reinterpret_cast<T*>(0)))>
     {
         typedef Task<decltype(f(*reinterpret_cast<T*>(0)))> NextTask;
         
@@ -107,7 +230,7 @@ public:
             return f(result);
         };
         
-        typename NextTask::Work::Ptr work = std::make_shared<typename NextTask::Work>(queueId, g);
+        typename NextTask::Work::Ptr work = std::make_shared<typename NextTask::Work>(queue, g, priority);
         m_work->addNextWork(work);
         return NextTask(work);
     }
@@ -115,12 +238,17 @@ public:
     template <typename Func>
     auto then(const Func& f) -> Task<decltype(f())>
     {
-        uint32_t queueId = m_work->getQueueId();
-        return then(queueId, f);
+        return then(m_work->getQueue(), f);
     }
     
     template <typename Func>
-    auto then(uint32_t queueId, const Func& f) -> Task<decltype(f())>
+    auto then(QueueRef queue, const Func& f) -> Task<decltype(f())>
+    {
+        return then(queue, f, m_work->getPriority());
+    }
+    
+    template <typename Func>
+    auto then(QueueRef queue, const Func& f, uint32_t priority) -> Task<decltype(f())>
     {
         typedef Task<decltype(f())> NextTask;
         
@@ -131,7 +259,7 @@ public:
             return f();
         };
         
-        typename NextTask::Work::Ptr work = std::make_shared<typename NextTask::Work>(queueId, g);
+        typename NextTask::Work::Ptr work = std::make_shared<typename NextTask::Work>(queue, g, priority);
         m_work->addNextWork(work);
         return NextTask(work);
     }
@@ -140,6 +268,33 @@ private:
     template <typename S>
     friend class Task;
     
+    template <typename S>
+    friend class Details::CoroutinePromiseBase;
+
+    // a pool worker waiting on a task keeps running other jobs of its pool until
+    // the task completes, so nested waits in fork/join code can't starve the pool
+    void helpWhileWaiting() const
+    {
+        if (!ThreadPoolQueue::isWorkerThread())
+            return;
+        
+        const std::chrono::microseconds maxBackoff(1000);
+        std::chrono::microseconds backoff(50);
+        const std::shared_future<T>& future = m_work->getFuture();
+        while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        {
+            if (ThreadPoolQueue::helpOnCurrentWorker())
+            {
+                backoff = std::chrono::microseconds(50);
+                continue;
+            }
+            
+            // nothing to help with, wait a little for either the task or new jobs
+            future.wait_for(backoff);
+            backoff = std::min(backoff * 2, maxBackoff);
+        }
+    }
+    
     class Work
         : public Details::Schedulable
     {
@@ -149,34 +304,40 @@ private:
         
         
         Work()
-        : m_queueId(0)
         {
         }
         
         template <typename F>
-        Work(uint32_t queueId0, const F& f)
-            : m_queueId(queueId0)
+        Work(QueueRef queue0, const F& f, uint32_t priority0)
+            : Work(queue0, priority0)
+        {
+            createWorkFunc(f);
+        }
+        
+        // work without a function of its own, it never runs and is finished by complete()
+        Work(QueueRef queue0, uint32_t priority0)
+            : m_queue(queue0)
+            , m_priority(priority0)
             , m_stateMachine(State::Waiting)
         {
             m_future = m_promise.get_future().share();
-            createWorkFunc(f);
             
             // Waiting --(Schedule)--> Scheduled
             // causes function to be enqueued
             auto enqueueFunc = [this](State, State, Transition) {
-                // create a shared ptr to this and capture it in the lambda below
-                // so that "this" is kept alive until after after the lambda is executed (or canceled)
-                Work::Ptr sharedThis = std::dynamic_pointer_cast<Work>(shared_from_this());
-                m_jobId = Async::enqueue(m_queueId, [sharedThis]() {
-                    sharedThis->m_stateMachine.executeTransition(Transition::RunStart);
-                    sharedThis->m_stateMachine.executeTransition(Transition::RunEnd);
-                });
+                ASYNC_HOOK(onTaskTransition(this, Observer::TaskEvent::Scheduled));
+                m_jobId = m_queue.enqueue(makeJob(), m_priority);
             };
             m_stateMachine.addTransition(State::Waiting, State::Scheduled, Transition::Schedule, enqueueFunc);
             
+            // Waiting --(ScheduleBatch)--> Scheduled
+            // the caller enqueues makeJob() together with other work
+            m_stateMachine.addTransition(State::Waiting, State::Scheduled, Transition::ScheduleBatch, nullptr);
+            
             // Scheduled --(RunStart)--> Running
             // causes work to be run
             auto runWork = [this](State, State, Transition) {
+                ASYNC_HOOK(onTaskTransition(this, Observer::TaskEvent::Started));
                 m_func();
             };
             m_stateMachine.addTransition(State::Scheduled, State::Running, Transition::RunStart, runWork);
@@ -184,24 +345,51 @@ private:
             // Running --(RunEnd)--> Completed
             // causes next work items to be scheduled
             auto workCompleted = [this](State, State, Transition) {
+                ASYNC_HOOK(onTaskTransition(this, Observer::TaskEvent::Completed));
                 notifyCompletionHandlers();
                 scheduleNextWork();
             };
             m_stateMachine.addTransition(State::Running, State::Completed, Transition::RunEnd, workCompleted);
             
+            // Waiting --(Complete)--> Completed
+            // stores the result given to complete(). runs under the state machine lock,
+            // so completion handlers added concurrently never see a missing result
+            auto storeResult = [this](State, State, Transition) {
+                ASYNC_HOOK(onTaskTransition(this, Observer::TaskEvent::Completed));
+                m_func();
+            };
+            m_stateMachine.addTransition(State::Waiting, State::Completed, Transition::Complete, storeResult, true);
+            
             // {Waiting, Scheduled} --(Cancel)--> Canceled
             // cancel work function from being executed
             auto cancelWork = [this](State, State, Transition) {
-                Async::cancel(m_jobId);
+                ASYNC_HOOK(onTaskTransition(this, Observer::TaskEvent::Canceled));
+                if (m_jobId != 0)
+                    m_queue.cancel(m_jobId);
                 m_jobId = 0;
+                if (m_watchId != 0)
+                    m_reactor->cancel(m_watchId);
+                m_watchId = 0;
+                workCanceled();
             };
             m_stateMachine.addTransition(State::Waiting, State::Canceled, Transition::Cancel, cancelWork);
             m_stateMachine.addTransition(State::Scheduled, State::Canceled, Transition::Cancel, cancelWork);
+            
+            // Scheduled --(Abandon)--> Canceled
+            // the queued job was dropped without running (queue cleared or shut down)
+            auto abandonWork = [this](State, State, Transition) {
+                ASYNC_HOOK(onTaskTransition(this, Observer::TaskEvent::Canceled));
+                m_jobId = 0;
+                workCanceled();
+            };
+            m_stateMachine.addTransition(State::Scheduled, State::Canceled, Transition::Abandon, abandonWork);
         }
         
+        // the queue this work runs on, known before it is enqueued and for work that
+        // is completed in place (0 if it has none)
         uint32_t getQueueId() const override
         {
-            return m_jobId >> 32;
+            return m_queue.getId();
         }
         
         uint64_t getJobId() const override
@@ -209,12 +397,67 @@ private:
             return m_jobId;
         }
         
+        QueueRef getQueue() const
+        {
+            return m_queue;
+        }
+        
+        uint32_t getPriority() const
+        {
+            return m_priority;
+        }
+        
         virtual bool schedule() override
         {
             State newState = m_stateMachine.executeTransition(Transition::Schedule);
             return (newState == State::Scheduled);
         }
         
+        // moves to Scheduled without enqueueing, on success appends the job that
+        // runs this work to jobs. the caller must enqueue it and call setJobId()
+        bool scheduleBatch(std::vector<JobFunc>& jobs)
+        {
+            State newState = m_stateMachine.executeTransition(Transition::ScheduleBatch);
+            if (newState != State::Scheduled)
+                return false;
+            
+            ASYNC_HOOK(onTaskTransition(this, Observer::TaskEvent::Scheduled));
+            jobs.push_back(makeJob());
+            return true;
+        }
+        
+        void setJobId(uint64_t jobId)
+        {
+            m_jobId = jobId;
+        }
+        
+        // the reactor watch that schedules this work, dropped if it is canceled first
+        void setWatch(Reactor& reactor, uint64_t watchId)
+        {
+            std::lock_guard<std::mutex> lock(m_stateMachine.getMutex());
+            m_reactor = &reactor;
+            m_watchId = watchId;
+        }
+        
+        // finishes waiting work in place, setResult fulfils the promise. returns false
+        // if the work was canceled (or completed) first
+        bool complete(const std::function<void(std::promise<T>&)>& setResult)
+        {
+            bool stored = false;
+            m_func = [this, &setResult, &stored]() {
+                setResult(m_promise);
+                stored = true;
+            };
+            m_stateMachine.executeTransition(Transition::Complete);
+            m_func = nullptr;
+            if (!stored)
+                return false;
+
+            notifyCompletionHandlers();
+            scheduleNextWork();
+            return true;
+        }
+
         virtual bool cancel() override
         {
             State newState = m_stateMachine.executeTransition(Transition::Cancel);
@@ -237,6 +480,9 @@ private:
         {
             bool added = false;
             
+            if (Details::isTracing())
+                Details::traceEdge(static_cast<Details::Schedulable*>(this), next.get());
+            
             std::lock_guard<std::mutex> lock(m_stateMachine.getMutex());
             State current = m_stateMachine.getCurrentState();
             switch (current)
@@ -248,9 +494,11 @@ private:
                     break;
                 }
                 case Work::State::Canceled:
-                    // do nothing, work was canceled
-                    // throw an exception here?
+                {
+                    // the continuation can never run, cancel it so its waiters wake
+                    next->cancel();
                     break;
+                }
                 default:
                 {
                     // all other states (waiting, scheduled, running)
@@ -313,12 +561,72 @@ private:
         enum class Transition
         {
             Schedule,
+            ScheduleBatch,
             RunStart,
             RunEnd,
             Complete,
-            Cancel
+            Cancel,
+            Abandon
         };
         
+        // the queued job for a Work. it keeps the Work alive until it has run, and
+        // abandons the Work if it is destroyed without running
+        class Job
+        {
+        public:
+            explicit Job(Work::Ptr work)
+                : m_work(std::move(work))
+            {
+            }
+            
+            Job(Job&& other) noexcept
+                : m_work(std::move(other.m_work))
+            {
+            }
+            
+            ~Job()
+            {
+                if (m_work)
+                    m_work->m_stateMachine.executeTransition(Transition::Abandon);
+            }
+            
+            void operator()()
+            {
+                Work::Ptr work = std::move(m_work);
+                if (Details::isTracing())
+                    Details::traceTaskRun(static_cast<Details::Schedulable*>(work.get()));
+                work->m_stateMachine.executeTransition(Transition::RunStart);
+                work->m_stateMachine.executeTransition(Transition::RunEnd);
+            }
+            
+        private:
+            Work::Ptr m_work;
+        };
+        
+        JobFunc makeJob()
+        {
+            return JobFunc(Job(std::dynamic_pointer_cast<Work>(shared_from_this())));
+        }
+        
+        // wakes anyone waiting on the future and cancels the continuations, which
+        // can never run now
+        void workCanceled()
+        {
+            // abandoning the promise stores a broken_promise future_error
+            {
+                std::promise<T> abandoned(std::move(m_promise));
+            }
+            
+            std::vector<typename Details::Schedulable::Ptr> nextWorkCopy;
+            {
+                std::lock_guard<std::mutex> lock(m_stateMachine.getMutex());
+                nextWorkCopy.swap(m_nextWork);
+            }
+            
+            for (auto next : nextWorkCopy)
+                next->cancel();
+        }
+        
         template <typename F>
         void createWorkFunc(const F& f)
         {
@@ -358,11 +666,14 @@ private:
                 next->schedule();
         }
         
-        uint32_t m_queueId = 0;
+        QueueRef m_queue;
+        uint32_t m_priority = 0;
         std::function<void(void)> m_func;
         std::promise<T> m_promise;
         std::shared_future<T> m_future;
         uint64_t m_jobId = 0;
+        Reactor* m_reactor = nullptr;
+        uint64_t m_watchId = 0;
         std::vector<typename Details::Schedulable::Ptr> m_nextWork;
         Util::StateMachineT<State, Transition> m_stateMachine;
         std::map<uint32_t, CompletionFunc> m_completionHandlers;
@@ -388,13 +699,42 @@ void Task<void>::Work::createWorkFunc(const F& f)
 }
 
 template <typename Func>
-auto CreateTask(uint32_t queueId, const Func& f) -> Task<decltype(f())>
+auto CreateTask(QueueRef queue, const Func& f, uint32_t priority = 0) -> Task<decltype(f())>
+{
+    return Task<decltype(f())>(queue, f, priority);
+}
+
+template <typename Func>
+auto CreateTasks(QueueRef queue, size_t count, const Func& f, uint32_t priority = 0) -> std::vector<Task<decltype(f(size_t()))>>
 {
-    return Task<decltype(f())>(queueId, f);
+    return Task<decltype(f(size_t()))>::createBatch(queue, count, f, priority);
 }
 
+template <typename Func>
+auto WhenSpaceAvailable(Queue& target, QueueRef queue, const Func& f, uint32_t priority = 0) -> Task<decltype(f())>
+{
+    return Task<decltype(f())>::whenSpaceAvailable(target, queue, f, priority);
+}
+
+// complete on queue once fd is readable (or writable) on the default reactor, or
+// reports an error or hang-up. readiness can be spurious, so use non-blocking
+// descriptors and wait again on EAGAIN
+inline Task<void> whenReadable(int fd, QueueRef queue, uint32_t priority = 0)
+{
+    return Task<void>::whenReady(Reactor::getDefault(), fd, Reactor::Readable, queue, []() {}, priority);
+}
+
+inline Task<void> whenWritable(int fd, QueueRef queue, uint32_t priority = 0)
+{
+    return Task<void>::whenReady(Reactor::getDefault(), fd, Reactor::Writable, queue, []() {}, priority);
+}
+
+// the first input to complete wins a compare-exchange and completes the returned
+// task in place, with a vector holding just that input. no thread waits, and the
+// other inputs' handlers stay registered until they fire and find the race lost.
+// the returned task never runs on queue, but continuations inherit queue and priority
 template <typename Iter>
-auto WhenAny(uint32_t queueId, Iter begin, Iter end) -> Task<std::vector<Task<decltype(begin->get())>>>
+auto WhenAny(QueueRef queue, Iter begin, Iter end, uint32_t priority = 0) -> Task<std::vector<Task<decltype(begin->get())>>>
 {
     using TaskType = Task<decltype(begin->get())>;
     using TaskVector = std::vector<TaskType>;
@@ -403,45 +743,27 @@ auto WhenAny(uint32_t queueId, Iter begin, Iter end) -> Task<std::vector<Task<de
     TaskVector tasks;
     std::copy(begin, end, std::back_inserter(tasks));
     
-    auto f = [tasks]() {
-        std::mutex mutex;
-        std::condition_variable cond;
-        TaskVector completed;
-        
-        auto completionCallback = [&mutex, &cond, &completed](TaskType task) {
-            {
-                std::lock_guard<std::mutex> lock(mutex);
-                completed.push_back(task);
-            }
-            cond.notify_one();
-        };
-        
-        std::vector<uint32_t> tokens;
+    auto won = std::make_shared<std::atomic<bool>>(false);
+    return Task<TaskVector>::whenResolved(queue, priority, [&tasks, &won](const std::function<bool(const TaskVector&)>& resolve) {
         for (auto t : tasks)
         {
-            uint32_t token = t.addCompletionHandler(completionCallback);
-            tokens.push_back(token);
-        }
-        
-        std::unique_lock<std::mutex> lock(mutex);
-        while (completed.size() == 0)
-            cond.wait(lock);
-
-        size_t i = 0;
-        for (auto t : tasks)
-        {
-            uint32_t token = tokens[i++];
-            t.removeCompletionHandler(token);
+            t.addCompletionHandler([won, resolve](TaskType task) {
+                bool expected = false;
+                if (won->compare_exchange_strong(expected, true, std::memory_order_acq_rel))
+                    resolve(TaskVector(1, task));
+            });
+            
+            // inputs that are already complete settle it right here
+            if (won->load(std::memory_order_relaxed))
+                break;
         }
-        
-        return completed;
-    };
-    
-    return CreateTask(queueId, f);
+    });
 }
 
+// the returned task is only enqueued once the last input has completed, no thread
+// waits for the inputs. completed tasks are listed in completion order
 template <typename Iter>
-auto WhenAll(uint32_t queueId, Iter begin, Iter end) -> Task<std::vector<Task<decltype(begin->get())>>>
+auto WhenAll(QueueRef queue, Iter begin, Iter end, uint32_t priority = 0) -> Task<std::vector<Task<decltype(begin->get())>>>
 {
     using TaskType = Task<decltype(begin->get())>;
     using TaskVector = std::vector<TaskType>;
@@ -449,58 +771,60 @@ auto WhenAll(uint32_t queueId, Iter begin, Iter end) -> Task<std::vector<Task<de
     // make a copy of the input
     TaskVector tasks;
     std::copy(begin, end, std::back_inserter(tasks));
-
-    auto f = [tasks]() {
-        std::mutex mutex;
-        std::condition_variable cond;
+    
+    // each completion claims the next slot for its input's index, the one that counts
+    // remaining down to zero schedules the aggregate task
+    struct State
+    {
+        TaskVector tasks;
+        std::vector<size_t> order;
+        std::atomic<size_t> nextSlot{0};
+        std::atomic<size_t> remaining{0};
+    };
+    
+    auto state = std::make_shared<State>();
+    state->tasks.swap(tasks);
+    state->order.resize(state->tasks.size());
+    state->remaining = state->tasks.size() + 1;
+    
+    auto f = [state]() {
         TaskVector completed;
-        
-        auto completionCallback = [&mutex, &cond, &completed](TaskType task) {
-            {
-                std::lock_guard<std::mutex> lock(mutex);
-                completed.push_back(task);
-            }
-            cond.notify_one();
-        };
-        
-        uint32_t total = 0;
-        std::vector<uint32_t> tokens;
-        for (auto t : tasks)
-        {
-            uint32_t token = t.addCompletionHandler(completionCallback);
-            tokens.push_back(token);
-            ++total;
-        }
-        
-        std::unique_lock<std::mutex> lock(mutex);
-        while (completed.size() < total)
-            cond.wait(lock);
-        
-        size_t i = 0;
-        for (auto t : tasks)
-        {
-            uint32_t token = tokens[i++];
-            t.removeCompletionHandler(token);
-        }
-
+        completed.reserve(state->order.size());
+        for (size_t index : state->order)
+            completed.push_back(state->tasks[index]);
         return completed;
     };
     
-    return CreateTask(queueId, f);
+    return Task<TaskVector>::whenSignaled(queue, f, priority, [&state](const std::function<void()>& signal) {
+        for (size_t i=0; i<state->tasks.size(); i++)
+        {
+            state->tasks[i].addCompletionHandler([state, signal, i](TaskType) {
+                state->order[state->nextSlot.fetch_add(1, std::memory_order_relaxed)] = i;
+                if (state->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    signal();
+            });
+        }
+        
+        // the extra count keeps inputs completing during registration from firing early
+        if (state->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            signal();
+    });
 }
 
+// the combined task takes the left operand's queue and priority
 template <typename T>
 Task<std::vector<Task<T>>> operator||(const Task<T>& a, const Task<T>& b)
 {
     auto tasks = {a,b};
-    return WhenAny(a.getQueueId(), begin(tasks), end(tasks));
+    return WhenAny(a.getQueue(), begin(tasks), end(tasks), a.getPriority());
 }
 
+// the combined task takes the left operand's queue and priority
 template <typename T>
 Task<std::vector<Task<T>>> operator&&(const Task<T>& a, const Task<T>& b)
 {
     auto tasks = {a,b};
-    return WhenAll(a.getQueueId(), begin(tasks), end(tasks));
+    return WhenAll(a.getQueue(), begin(tasks), end(tasks), a.getPriority());
 }
 
 ASYNC_END
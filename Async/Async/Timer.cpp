@@ -0,0 +1,342 @@
+#include "Async/Timer.h"
+#include "Async/Queue.h"
+
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+ASYNC_BEGIN
+
+namespace
+{
+    class TimerWheel
+    {
+    public:
+        static TimerWheel& instance()
+        {
+            static TimerWheel wheel;
+            return wheel;
+        }
+        
+        TimerWheel()
+            : m_epoch(TimerClock::now())
+        {
+            m_thread = std::thread(&TimerWheel::run, this);
+        }
+        
+        ~TimerWheel()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_running = false;
+            }
+            m_cond.notify_one();
+            m_thread.join();
+            
+            for (auto& it : m_timers)
+                delete it.second;
+        }
+        
+        uint64_t add(uint32_t queueId, TimerClock::time_point when, TimerClock::duration period, JobFunc&& func, uint32_t priority)
+        {
+            std::unique_ptr<Timer> timer(new Timer);
+            timer->queueId = queueId;
+            timer->priority = priority;
+            if (period > TimerClock::duration::zero())
+            {
+                timer->periodTicks = std::max<uint64_t>(1, ticksCeil(period));
+                timer->shared = std::make_shared<JobFunc>(std::move(func));
+            }
+            else
+            {
+                timer->func = std::move(func);
+            }
+            
+            bool wake = false;
+            uint64_t timerId = 0;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (++m_nextTimerNumber == 0)
+                    ++m_nextTimerNumber;
+                
+                timerId = (static_cast<uint64_t>(TimerQueueId) << 32) | m_nextTimerNumber;
+                timer->id = timerId;
+                
+                // never insert into the tick that has already been processed
+                uint64_t expiry = (when > m_epoch) ? ticksCeil(when - m_epoch) : 0;
+                timer->expiry = std::max(expiry, m_now + 1);
+                
+                insert(timer.get());
+                m_timers.insert(std::make_pair(timerId, timer.get()));
+                wake = (timer->expiry < m_wakeTick);
+                timer.release();
+            }
+            
+            if (wake)
+                m_cond.notify_one();
+            
+            return timerId;
+        }
+        
+        bool cancel(uint64_t timerId)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_timers.find(timerId);
+            if (it == m_timers.end())
+                return false;
+            
+            Timer* timer = it->second;
+            unlink(timer);
+            m_timers.erase(it);
+            delete timer;
+            return true;
+        }
+        
+        size_t size()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_timers.size();
+        }
+        
+    private:
+        static const uint32_t SlotBits = 8;
+        static const uint32_t NumSlots = 1u << SlotBits;
+        static const uint32_t SlotMask = NumSlots - 1;
+        static const uint32_t NumLevels = 4;
+        
+        typedef std::chrono::milliseconds Tick;
+        
+        // a due job on its way to the target queue
+        struct Firing
+        {
+            uint32_t queueId = 0;
+            uint32_t priority = 0;
+            JobFunc func;
+        };
+        
+        struct Timer
+        {
+            uint64_t id = 0;
+            uint64_t expiry = 0;      // in ticks since m_epoch
+            uint64_t periodTicks = 0; // 0 for one-shot timers
+            uint32_t queueId = 0;
+            uint32_t priority = 0;
+            JobFunc func;                     // one-shot
+            std::shared_ptr<JobFunc> shared;  // periodic
+            
+            // intrusive slot list
+            Timer* prev = nullptr;
+            Timer* next = nullptr;
+            Timer** head = nullptr;
+        };
+        
+        static uint64_t ticksCeil(TimerClock::duration d)
+        {
+            Tick ticks = std::chrono::duration_cast<Tick>(d);
+            if (ticks < d)
+                ticks += Tick(1);
+            return static_cast<uint64_t>(ticks.count());
+        }
+        
+        uint64_t currentTick() const
+        {
+            Tick ticks = std::chrono::duration_cast<Tick>(TimerClock::now() - m_epoch);
+            return static_cast<uint64_t>(ticks.count());
+        }
+        
+        void insert(Timer* timer)
+        {
+            // level L holds timers due within 256^(L+1) ticks, slotted by the
+            // matching byte of their expiry. timers further out than the top level
+            // are parked at its far end and re-inserted when it cascades
+            uint64_t expiry = std::max(timer->expiry, m_now);
+            uint64_t delta = expiry - m_now;
+            uint32_t level = 0;
+            while (level < NumLevels - 1 && delta >= (1ull << (SlotBits * (level + 1))))
+                level++;
+            
+            if (delta >= (1ull << (SlotBits * NumLevels)))
+                expiry = m_now + (1ull << (SlotBits * NumLevels)) - 1;
+            
+            uint32_t slot = (expiry >> (SlotBits * level)) & SlotMask;
+            Timer** head = &m_slots[level][slot];
+            timer->head = head;
+            timer->prev = nullptr;
+            timer->next = *head;
+            if (*head)
+                (*head)->prev = timer;
+            *head = timer;
+        }
+        
+        void unlink(Timer* timer)
+        {
+            if (!timer->head)
+                return;
+            
+            if (timer->prev)
+                timer->prev->next = timer->next;
+            else
+                *timer->head = timer->next;
+            
+            if (timer->next)
+                timer->next->prev = timer->prev;
+            
+            timer->head = nullptr;
+            timer->prev = nullptr;
+            timer->next = nullptr;
+        }
+        
+        // moves the wheel forward by one tick and fires everything due in it
+        void advance()
+        {
+            m_now++;
+            
+            // when a level wraps, pull the next slot of the level above down
+            uint32_t index = m_now & SlotMask;
+            for (uint32_t level=1; level<NumLevels && index==0; level++)
+            {
+                index = (m_now >> (SlotBits * level)) & SlotMask;
+                Timer* timer = m_slots[level][index];
+                m_slots[level][index] = nullptr;
+                while (timer)
+                {
+                    Timer* next = timer->next;
+                    insert(timer);
+                    timer = next;
+                }
+            }
+            
+            Timer* timer = m_slots[0][m_now & SlotMask];
+            m_slots[0][m_now & SlotMask] = nullptr;
+            while (timer)
+            {
+                Timer* next = timer->next;
+                timer->head = nullptr;
+                fire(timer);
+                timer = next;
+            }
+        }
+        
+        void fire(Timer* timer)
+        {
+            assert(timer->expiry <= m_now);
+            
+            Firing firing;
+            firing.queueId = timer->queueId;
+            firing.priority = timer->priority;
+            
+            if (timer->periodTicks == 0)
+            {
+                firing.func = std::move(timer->func);
+                m_due.push_back(std::move(firing));
+                m_timers.erase(timer->id);
+                delete timer;
+                return;
+            }
+            
+            std::shared_ptr<JobFunc> shared = timer->shared;
+            firing.func = [shared]() {
+                (*shared)();
+            };
+            m_due.push_back(std::move(firing));
+            
+            // don't try to make up for missed periods with a burst of firings
+            timer->expiry = std::max(timer->expiry + timer->periodTicks, m_now + 1);
+            insert(timer);
+        }
+        
+        // ticks from m_now until the next non-empty level 0 slot or the next cascade
+        uint64_t ticksUntilNextEvent() const
+        {
+            uint64_t limit = NumSlots - (m_now & SlotMask);
+            for (uint64_t i=1; i<limit; i++)
+            {
+                if (m_slots[0][(m_now + i) & SlotMask])
+                    return i;
+            }
+            return limit;
+        }
+        
+        void run()
+        {
+            std::vector<Firing> due;
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (m_running)
+            {
+                uint64_t target = currentTick();
+                if (m_timers.empty())
+                {
+                    // nothing to cascade or fire, just catch up
+                    m_now = std::max(m_now, target);
+                }
+                else
+                {
+                    while (m_now < target)
+                        advance();
+                }
+                
+                // due jobs are enqueued with the wheel unlocked, so a full bounded
+                // queue that blocks (or runs the job on this thread) can't hold up
+                // timers being added or canceled, including by the job itself
+                if (!m_due.empty())
+                {
+                    due.swap(m_due);
+                    lock.unlock();
+                    for (Firing& firing : due)
+                        Async::enqueue(firing.queueId, std::move(firing.func), firing.priority);
+                    due.clear();
+                    lock.lock();
+                    continue;
+                }
+                
+                if (m_timers.empty())
+                {
+                    m_wakeTick = UINT64_MAX;
+                    m_cond.wait(lock);
+                }
+                else
+                {
+                    m_wakeTick = m_now + ticksUntilNextEvent();
+                    m_cond.wait_until(lock, m_epoch + Tick(m_wakeTick));
+                }
+            }
+        }
+        
+        TimerClock::time_point m_epoch;
+        std::mutex m_mutex;
+        std::condition_variable m_cond;
+        bool m_running = true;
+        uint64_t m_now = 0;
+        uint64_t m_wakeTick = UINT64_MAX;
+        uint32_t m_nextTimerNumber = 0;
+        Timer* m_slots[NumLevels][NumSlots] = {};
+        std::unordered_map<uint64_t, Timer*> m_timers;
+        std::vector<Firing> m_due;
+        std::thread m_thread;
+    };
+}
+
+namespace Details
+{
+    uint64_t addTimer(uint32_t queueId, TimerClock::time_point when, TimerClock::duration period, JobFunc&& func, uint32_t priority)
+    {
+        return TimerWheel::instance().add(queueId, when, period, std::move(func), priority);
+    }
+    
+    bool cancelTimer(uint64_t timerId)
+    {
+        return TimerWheel::instance().cancel(timerId);
+    }
+    
+    size_t numPendingTimers()
+    {
+        return TimerWheel::instance().size();
+    }
+}
+
+ASYNC_END
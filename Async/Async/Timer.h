@@ -0,0 +1,51 @@
+#pragma once
+
+#include "Async/Base.h"
+#include "Async/JobFunc.h"
+
+#include <chrono>
+#include <cstdint>
+#include <utility>
+
+ASYNC_BEGIN
+
+// Delayed and periodic jobs are kept in a hierarchical hashed timing wheel
+// (4 levels of 256 slots, 1ms ticks) served by a single timer thread, which hands
+// due jobs to their target queue through Async::enqueue.
+//
+// Timer ids carry TimerQueueId in their upper 32 bits and can be canceled with
+// Async::cancel(). Canceling a periodic timer stops future firings; a firing that
+// is already due still reaches its queue, where it is an ordinary job with an id of
+// its own.
+typedef std::chrono::steady_clock TimerClock;
+
+const uint32_t TimerQueueId = 0xffffffff;
+
+namespace Details
+{
+    uint64_t addTimer(uint32_t queueId, TimerClock::time_point when, TimerClock::duration period, JobFunc&& func, uint32_t priority);
+    bool cancelTimer(uint64_t timerId);
+    size_t numPendingTimers();
+}
+
+template <typename F>
+uint64_t enqueueAt(uint32_t queueId, TimerClock::time_point when, F&& func, uint32_t priority = 0)
+{
+    return Details::addTimer(queueId, when, TimerClock::duration::zero(), JobFunc(std::forward<F>(func)), priority);
+}
+
+template <typename F>
+uint64_t enqueueAfter(uint32_t queueId, TimerClock::duration delay, F&& func, uint32_t priority = 0)
+{
+    return enqueueAt(queueId, TimerClock::now() + delay, std::forward<F>(func), priority);
+}
+
+// the first firing happens one period from now. firings are not serialized, if a
+// run takes longer than the period the next one may overlap it on a pool queue
+template <typename F>
+uint64_t enqueueEvery(uint32_t queueId, TimerClock::duration period, F&& func, uint32_t priority = 0)
+{
+    return Details::addTimer(queueId, TimerClock::now() + period, period, JobFunc(std::forward<F>(func)), priority);
+}
+
+ASYNC_END
@@ -0,0 +1,412 @@
+#include "Async/Trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+ASYNC_BEGIN
+
+namespace Details
+{
+    std::atomic<bool> s_tracing{false};
+}
+
+namespace
+{
+    enum class EventType : uint8_t
+    {
+        Enqueue,  // a = job id
+        JobStart, // a = job id
+        JobEnd,   // a = job id
+        TaskRun,  // a = work, b = job id
+        Edge      // a = parent work, b = next work
+    };
+    
+    struct Event
+    {
+        int64_t ticks;
+        uint64_t a;
+        uint64_t b;
+        EventType type;
+    };
+    
+    // written by its thread only. a new session (startTracing) is picked up by
+    // the thread's next event, which resets the buffer. an exiting thread hands its
+    // buffer back, and the next new thread appends to it so unwritten events survive
+    struct ThreadBuffer
+    {
+        std::atomic<bool> inUse{false};
+        uint32_t index = 0;
+        std::atomic<uint64_t> session{0};
+        size_t capacity = 0;
+        std::unique_ptr<Event[]> events;
+        std::atomic<size_t> count{0};
+        std::atomic<uint64_t> numLost{0};
+        std::vector<uint64_t> runningJobs; // jobs nest when a worker helps while waiting
+        ThreadBuffer* next = nullptr;
+    };
+    
+    std::atomic<uint64_t> s_session{0};
+    std::atomic<size_t> s_capacity{0};
+    std::atomic<ThreadBuffer*> s_buffers{nullptr}; // push-only list, buffers are never freed
+    std::atomic<uint32_t> s_numBuffers{0};
+    
+    ThreadBuffer* acquireThreadBuffer()
+    {
+        for (ThreadBuffer* buffer = s_buffers.load(); buffer; buffer = buffer->next)
+        {
+            bool expected = false;
+            if (!buffer->inUse.load(std::memory_order_relaxed) && buffer->inUse.compare_exchange_strong(expected, true))
+            {
+                // whatever the previous owner was running ended with it
+                buffer->runningJobs.clear();
+                return buffer;
+            }
+        }
+        
+        ThreadBuffer* buffer = new ThreadBuffer;
+        buffer->inUse = true;
+        buffer->index = s_numBuffers++;
+        buffer->next = s_buffers.load();
+        while (!s_buffers.compare_exchange_weak(buffer->next, buffer)) {}
+        return buffer;
+    }
+    
+    // hands the thread's buffer back for reuse when the thread exits
+    struct ThreadBufferOwner
+    {
+        ~ThreadBufferOwner()
+        {
+            if (buffer)
+                buffer->inUse.store(false, std::memory_order_release);
+        }
+        
+        ThreadBuffer* buffer = nullptr;
+    };
+    
+    thread_local ThreadBufferOwner s_threadBuffer;
+    
+    int64_t nowTicks()
+    {
+        return std::chrono::steady_clock::now().time_since_epoch().count();
+    }
+    
+    ThreadBuffer* threadBuffer()
+    {
+        ThreadBuffer*& buffer = s_threadBuffer.buffer;
+        if (!buffer)
+            buffer = acquireThreadBuffer();
+        
+        uint64_t session = s_session.load(std::memory_order_acquire);
+        if (buffer->session.load(std::memory_order_relaxed) != session)
+        {
+            size_t capacity = s_capacity.load(std::memory_order_relaxed);
+            if (buffer->capacity != capacity)
+            {
+                buffer->events.reset(new Event[capacity]);
+                buffer->capacity = capacity;
+            }
+            buffer->count.store(0, std::memory_order_relaxed);
+            buffer->numLost.store(0, std::memory_order_relaxed);
+            buffer->runningJobs.clear();
+            buffer->session.store(session, std::memory_order_release);
+        }
+        return buffer;
+    }
+    
+    void record(ThreadBuffer* buffer, EventType type, uint64_t a, uint64_t b)
+    {
+        size_t n = buffer->count.load(std::memory_order_relaxed);
+        if (n >= buffer->capacity)
+        {
+            buffer->numLost.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        
+        Event event = { nowTicks(), a, b, type };
+        buffer->events[n] = event;
+        buffer->count.store(n + 1, std::memory_order_release);
+    }
+    
+    struct Slice
+    {
+        uint32_t tid = 0;
+        int64_t start = 0;
+        int64_t end = 0;
+    };
+    
+    struct Binding
+    {
+        int64_t ticks;
+        uint64_t jobId;
+    };
+    
+    // the binding closest to ticks, preferring the last one before it
+    const Binding* findBinding(const std::vector<Binding>& bindings, int64_t ticks, bool before)
+    {
+        const Binding* found = nullptr;
+        for (const auto& binding : bindings)
+        {
+            if (binding.ticks <= ticks)
+            {
+                if (before)
+                    found = &binding;
+            }
+            else
+            {
+                if (!found)
+                    found = &binding;
+                break;
+            }
+        }
+        return found;
+    }
+    
+    void writeJobId(std::ostream& out, uint64_t jobId)
+    {
+        out << "\"0x" << std::hex << jobId << std::dec << "\"";
+    }
+}
+
+void startTracing(size_t maxEventsPerThread)
+{
+    s_capacity.store(std::max<size_t>(1, maxEventsPerThread), std::memory_order_relaxed);
+    s_session.fetch_add(1, std::memory_order_acq_rel);
+    Details::s_tracing.store(true);
+}
+
+void stopTracing()
+{
+    Details::s_tracing.store(false);
+}
+
+void writeChromeTrace(std::ostream& out)
+{
+    struct ThreadEvents
+    {
+        uint32_t tid;
+        std::vector<Event> events;
+    };
+    
+    // copy what every thread recorded in the current session
+    std::vector<ThreadEvents> threads;
+    uint64_t numLost = 0;
+    uint64_t session = s_session.load(std::memory_order_acquire);
+    for (ThreadBuffer* buffer = s_buffers.load(); buffer; buffer = buffer->next)
+    {
+        if (buffer->session.load(std::memory_order_acquire) != session)
+            continue;
+        
+        ThreadEvents thread;
+        thread.tid = buffer->index;
+        size_t count = buffer->count.load(std::memory_order_acquire);
+        thread.events.assign(buffer->events.get(), buffer->events.get() + count);
+        numLost += buffer->numLost.load(std::memory_order_relaxed);
+        if (!thread.events.empty())
+            threads.push_back(std::move(thread));
+    }
+    
+    std::sort(threads.begin(), threads.end(), [](const ThreadEvents& a, const ThreadEvents& b) {
+        return a.tid < b.tid;
+    });
+    
+    int64_t epoch = INT64_MAX;
+    for (const auto& thread : threads)
+        epoch = std::min(epoch, thread.events.front().ticks);
+    
+    auto toUs = [epoch](int64_t ticks) {
+        std::chrono::steady_clock::duration d(ticks - epoch);
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() / 1000.0;
+    };
+    
+    // enqueues, task bindings and edges may be recorded on any thread
+    std::unordered_map<uint64_t, std::pair<int64_t, uint32_t>> enqueues;
+    std::unordered_map<uint64_t, std::vector<Binding>> bindings;
+    std::vector<Event> edges;
+    for (const auto& thread : threads)
+    {
+        for (const auto& event : thread.events)
+        {
+            if (event.type == EventType::Enqueue)
+                enqueues[event.a] = std::make_pair(event.ticks, thread.tid);
+            else if (event.type == EventType::TaskRun)
+                bindings[event.a].push_back(Binding{ event.ticks, event.b });
+            else if (event.type == EventType::Edge)
+                edges.push_back(event);
+        }
+    }
+    
+    for (auto& it : bindings)
+    {
+        std::sort(it.second.begin(), it.second.end(), [](const Binding& a, const Binding& b) {
+            return a.ticks < b.ticks;
+        });
+    }
+    
+    out << std::fixed << std::setprecision(3);
+    out << "{\"traceEvents\":[\n";
+    const char* separator = "";
+    
+    std::unordered_map<uint64_t, Slice> slices;
+    for (const auto& thread : threads)
+    {
+        std::vector<std::pair<uint64_t, int64_t>> running;
+        uint32_t firstQueueId = 0;
+        for (const auto& event : thread.events)
+        {
+            if (event.type == EventType::JobStart)
+            {
+                running.push_back(std::make_pair(event.a, event.ticks));
+                if (firstQueueId == 0)
+                    firstQueueId = static_cast<uint32_t>(event.a >> 32);
+                continue;
+            }
+            
+            // ends of jobs started before the session began have nothing to match
+            if (event.type != EventType::JobEnd || running.empty() || running.back().first != event.a)
+                continue;
+            
+            uint64_t jobId = event.a;
+            uint32_t queueId = static_cast<uint32_t>(jobId >> 32);
+            Slice slice;
+            slice.tid = thread.tid;
+            slice.start = running.back().second;
+            slice.end = event.ticks;
+            running.pop_back();
+            slices[jobId] = slice;
+            
+            out << separator << "{\"name\":\"queue " << queueId << "\",\"cat\":\"job\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread.tid
+                << ",\"ts\":" << toUs(slice.start) << ",\"dur\":" << toUs(slice.end) - toUs(slice.start)
+                << ",\"args\":{\"queue\":" << queueId << ",\"job\":";
+            writeJobId(out, jobId);
+            
+            auto enqueued = enqueues.find(jobId);
+            if (enqueued != enqueues.end())
+            {
+                // the enqueue event is recorded after the push, so it can trail the start
+                int64_t enqueueTicks = std::min(enqueued->second.first, slice.start);
+                out << ",\"wait_us\":" << toUs(slice.start) - toUs(enqueueTicks) << "}},\n";
+                out << "{\"name\":\"queue " << queueId << " wait\",\"cat\":\"wait\",\"ph\":\"b\",\"id\":";
+                writeJobId(out, jobId);
+                out << ",\"pid\":1,\"tid\":" << enqueued->second.second << ",\"ts\":" << toUs(enqueueTicks) << "},\n";
+                out << "{\"name\":\"queue " << queueId << " wait\",\"cat\":\"wait\",\"ph\":\"e\",\"id\":";
+                writeJobId(out, jobId);
+                out << ",\"pid\":1,\"tid\":" << enqueued->second.second << ",\"ts\":" << toUs(slice.start) << "}";
+            }
+            else
+            {
+                out << "}}";
+            }
+            separator = ",\n";
+        }
+        
+        // jobs still running when the trace was written only get a begin event
+        for (const auto& job : running)
+        {
+            Slice slice;
+            slice.tid = thread.tid;
+            slice.start = job.second;
+            slice.end = job.second;
+            slices[job.first] = slice;
+            
+            out << separator << "{\"name\":\"queue " << (job.first >> 32) << "\",\"cat\":\"job\",\"ph\":\"B\",\"pid\":1,\"tid\":" << thread.tid
+                << ",\"ts\":" << toUs(job.second) << ",\"args\":{\"queue\":" << (job.first >> 32) << ",\"job\":";
+            writeJobId(out, job.first);
+            out << "}}";
+            separator = ",\n";
+        }
+        
+        out << separator << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread.tid
+            << ",\"args\":{\"name\":\"thread " << thread.tid;
+        if (firstQueueId != 0)
+            out << " (queue " << firstQueueId << ")";
+        out << "\"}}";
+        separator = ",\n";
+    }
+    
+    // a flow arrow from the end of each parent job to the start of its continuation
+    uint64_t flowId = 0;
+    for (const auto& edge : edges)
+    {
+        auto parentBindings = bindings.find(edge.a);
+        auto nextBindings = bindings.find(edge.b);
+        if (parentBindings == bindings.end() || nextBindings == bindings.end())
+            continue;
+        
+        const Binding* parent = findBinding(parentBindings->second, edge.ticks, true);
+        const Binding* next = findBinding(nextBindings->second, edge.ticks, false);
+        if (!parent || !next)
+            continue;
+        
+        auto parentSlice = slices.find(parent->jobId);
+        auto nextSlice = slices.find(next->jobId);
+        if (parentSlice == slices.end() || nextSlice == slices.end())
+            continue;
+        
+        const Slice& from = parentSlice->second;
+        const Slice& to = nextSlice->second;
+        double fromUs = std::max(toUs(from.start), toUs(from.end) - 0.001);
+        flowId++;
+        out << separator << "{\"name\":\"then\",\"cat\":\"task\",\"ph\":\"s\",\"id\":" << flowId
+            << ",\"pid\":1,\"tid\":" << from.tid << ",\"ts\":" << fromUs << "},\n";
+        out << "{\"name\":\"then\",\"cat\":\"task\",\"ph\":\"f\",\"bp\":\"e\",\"id\":" << flowId
+            << ",\"pid\":1,\"tid\":" << to.tid << ",\"ts\":" << toUs(to.start) << "}";
+        separator = ",\n";
+    }
+    
+    out << "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"lostEvents\":" << numLost << "}}\n";
+}
+
+bool writeChromeTrace(const std::string& path)
+{
+    std::ofstream out(path.c_str());
+    if (!out)
+        return false;
+    
+    writeChromeTrace(out);
+    return static_cast<bool>(out);
+}
+
+namespace Details
+{
+    void traceEnqueue(uint64_t jobId)
+    {
+        record(threadBuffer(), EventType::Enqueue, jobId, 0);
+    }
+    
+    void traceJobStart(uint64_t jobId)
+    {
+        ThreadBuffer* buffer = threadBuffer();
+        buffer->runningJobs.push_back(jobId);
+        record(buffer, EventType::JobStart, jobId, 0);
+    }
+    
+    void traceJobEnd(uint64_t jobId)
+    {
+        ThreadBuffer* buffer = threadBuffer();
+        if (!buffer->runningJobs.empty())
+            buffer->runningJobs.pop_back();
+        record(buffer, EventType::JobEnd, jobId, 0);
+    }
+    
+    void traceTaskRun(const void* work)
+    {
+        ThreadBuffer* buffer = threadBuffer();
+        if (buffer->runningJobs.empty())
+            return;
+        
+        record(buffer, EventType::TaskRun, reinterpret_cast<uintptr_t>(work), buffer->runningJobs.back());
+    }
+    
+    void traceEdge(const void* parent, const void* next)
+    {
+        record(threadBuffer(), EventType::Edge, reinterpret_cast<uintptr_t>(parent), reinterpret_cast<uintptr_t>(next));
+    }
+}
+
+ASYNC_END
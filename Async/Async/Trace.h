@@ -0,0 +1,49 @@
+#pragma once
+
+#include "Async/Base.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+
+ASYNC_BEGIN
+
+// Opt-in execution tracing. While tracing, every thread appends to a buffer of
+// its own (no locks, no shared writes), recording when jobs are enqueued, start
+// and end, and which tasks continue which. A thread whose buffer is full drops
+// further events and counts them as lost. A thread that exits hands its buffer,
+// with the events not yet written out, to the next thread that starts tracing.
+//
+// The trace is written in the Chrome Trace Event JSON format, which both
+// chrome://tracing and ui.perfetto.dev load: jobs are slices on the threads that
+// ran them, queue waits are async slices and task continuations are flow arrows.
+void startTracing(size_t maxEventsPerThread = 1 << 16);
+void stopTracing();
+
+// call between stopTracing() and the next startTracing()
+void writeChromeTrace(std::ostream& out);
+bool writeChromeTrace(const std::string& path);
+
+namespace Details
+{
+    extern std::atomic<bool> s_tracing;
+    
+    inline bool isTracing()
+    {
+        return s_tracing.load(std::memory_order_relaxed);
+    }
+    
+    void traceEnqueue(uint64_t jobId);
+    void traceJobStart(uint64_t jobId);
+    void traceJobEnd(uint64_t jobId);
+    
+    // binds a task to the job running on the calling thread
+    void traceTaskRun(const void* work);
+    
+    // next continues parent
+    void traceEdge(const void* parent, const void* next);
+}
+
+ASYNC_END
@@ -0,0 +1,508 @@
+#include "Async/Coroutine.h"
+#include "Async/FileIO.h"
+#include "Async/Task.h"
+#include "Async/Timer.h"
+
+#include "catch.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Benchmarks are hidden test cases, run them explicitly with e.g. `Async [Benchmark]`.
+
+namespace Bench
+{
+    const uint32_t BenchQueue = 0xBE0000;
+    
+    typedef std::chrono::steady_clock Clock;
+    
+    // numThreads producers push numJobs trivial jobs into a pool of numThreads workers,
+    // returns jobs per second from first enqueue until the last job has run
+    double queueThroughput(const Async::ThreadPoolQueue::Options& options, uint32_t numThreads, uint32_t numJobs)
+    {
+        Async::ThreadPoolQueue queue(BenchQueue, numThreads, options);
+        std::atomic<uint32_t> count(0);
+        uint32_t jobsPerThread = numJobs / numThreads;
+        uint32_t total = jobsPerThread * numThreads;
+        
+        Clock::time_point start = Clock::now();
+        
+        std::vector<std::thread> producers;
+        for (uint32_t i=0; i<numThreads; i++)
+        {
+            producers.emplace_back([&queue, &count, jobsPerThread]() {
+                for (uint32_t j=0; j<jobsPerThread; j++)
+                    queue.enqueue([&count]() { count.fetch_add(1, std::memory_order_relaxed); });
+            });
+        }
+        
+        for (auto& producer : producers)
+            producer.join();
+        
+        while (count.load() < total)
+            std::this_thread::yield();
+        
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+        return total / elapsed.count();
+    }
+    
+    const size_t EchoSize = 64;
+    
+    int loopbackSocket()
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        return fd;
+    }
+    
+    // numConnections clients each make numRequests blocking round trips of EchoSize
+    // bytes against a loopback server, serve() gets every accepted connection and
+    // must close it once the client hangs up. returns requests per second
+    double echoRequestRate(uint32_t numConnections, uint32_t numRequests, const std::function<void(int)>& serve)
+    {
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(addr);
+        int listener = socket(AF_INET, SOCK_STREAM, 0);
+        bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        listen(listener, static_cast<int>(numConnections));
+        getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &length);
+        
+        std::vector<int> clients;
+        for (uint32_t i=0; i<numConnections; i++)
+        {
+            int client = loopbackSocket();
+            connect(client, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+            clients.push_back(client);
+            
+            int server = accept(listener, nullptr, nullptr);
+            int one = 1;
+            setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            serve(server);
+        }
+        close(listener);
+        
+        Clock::time_point start = Clock::now();
+        std::vector<std::thread> threads;
+        for (int client : clients)
+        {
+            threads.emplace_back([client, numRequests]() {
+                char buffer[EchoSize] = {};
+                for (uint32_t r=0; r<numRequests; r++)
+                {
+                    if (write(client, buffer, EchoSize) != static_cast<ssize_t>(EchoSize))
+                        return;
+                    for (size_t received=0; received<EchoSize; )
+                    {
+                        ssize_t n = read(client, buffer + received, EchoSize - received);
+                        if (n <= 0)
+                            return;
+                        received += n;
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+        
+        for (int client : clients)
+            close(client);
+        return numConnections * numRequests / elapsed.count();
+    }
+}
+
+TEST_CASE("queue storage benchmark", "[.][Benchmark][QueueStorageBenchmark]")
+{
+    const uint32_t numJobs = 256*1024;
+    
+    Async::ThreadPoolQueue::Options dequeOptions;
+    dequeOptions.storage = Async::Queue::Storage::Deque;
+    
+    Async::ThreadPoolQueue::Options ringOptions;
+    ringOptions.storage = Async::Queue::Storage::RingBuffer;
+    ringOptions.capacity = 64*1024;
+    
+    printf("%8s %16s %16s\n", "threads", "deque jobs/s", "ring jobs/s");
+    for (uint32_t numThreads=1; numThreads<=64; numThreads*=2)
+    {
+        double deque = Bench::queueThroughput(dequeOptions, numThreads, numJobs);
+        double ring = Bench::queueThroughput(ringOptions, numThreads, numJobs);
+        printf("%8u %16.0f %16.0f\n", numThreads, deque, ring);
+    }
+}
+
+TEST_CASE("queue cancel benchmark", "[.][Benchmark][QueueCancelBenchmark]")
+{
+    const uint32_t numCancels = 10000;
+    
+    printf("%10s %16s\n", "depth", "ns/cancel");
+    for (uint32_t depth=1000; depth<=1000000; depth*=10)
+    {
+        Async::Queue queue(Bench::BenchQueue);
+        std::vector<uint64_t> jobIds;
+        jobIds.reserve(depth);
+        for (uint32_t i=0; i<depth; i++)
+            jobIds.push_back(queue.enqueue([]() {}));
+        
+        // cancel jobs spread across the whole queue, never the front
+        uint32_t stride = std::max<uint32_t>(1, (depth - 1) / numCancels);
+        uint32_t count = 0;
+        Bench::Clock::time_point start = Bench::Clock::now();
+        for (uint32_t i=1; i<depth && count<numCancels; i+=stride, count++)
+            queue.cancel(jobIds[i]);
+        std::chrono::duration<double, std::nano> elapsed = Bench::Clock::now() - start;
+        
+        printf("%10u %16.1f\n", depth, elapsed.count() / count);
+    }
+}
+
+TEST_CASE("timer benchmark", "[.][Benchmark][TimerBenchmark]")
+{
+    const uint32_t numTimers = 1000000;
+    
+    std::vector<uint64_t> timerIds;
+    timerIds.reserve(numTimers);
+    
+    // spread deadlines over ~17 minutes so every wheel level gets used
+    Bench::Clock::time_point start = Bench::Clock::now();
+    for (uint32_t i=0; i<numTimers; i++)
+        timerIds.push_back(Async::enqueueAfter(Bench::BenchQueue, std::chrono::milliseconds(1 + i), []() {}));
+    std::chrono::duration<double, std::nano> added = Bench::Clock::now() - start;
+    
+    start = Bench::Clock::now();
+    for (uint64_t timerId : timerIds)
+        Async::cancel(timerId);
+    std::chrono::duration<double, std::nano> canceled = Bench::Clock::now() - start;
+    
+    printf("%10s %16s %16s\n", "timers", "ns/add", "ns/cancel");
+    printf("%10u %16.1f %16.1f\n", numTimers, added.count() / numTimers, canceled.count() / numTimers);
+}
+
+TEST_CASE("idle policy benchmark", "[.][Benchmark][IdlePolicyBenchmark]")
+{
+    const uint32_t numRoundTrips = 20000;
+    
+    // one job in flight at a time, so every enqueue finds the workers idle
+    auto roundTrip = [numRoundTrips](const Async::ThreadPoolQueue::Options& options) {
+        Async::ThreadPoolQueue queue(Bench::BenchQueue, 2, options);
+        std::atomic<uint32_t> count(0);
+        Bench::Clock::time_point start = Bench::Clock::now();
+        for (uint32_t i=0; i<numRoundTrips; i++)
+        {
+            queue.enqueue([&count]() { count.fetch_add(1, std::memory_order_release); });
+            while (count.load(std::memory_order_acquire) <= i)
+                std::this_thread::yield();
+        }
+        std::chrono::duration<double, std::nano> elapsed = Bench::Clock::now() - start;
+        return elapsed.count() / numRoundTrips;
+    };
+    
+    printf("%10s %10s %16s\n", "spins", "yields", "ns/round trip");
+    const uint32_t policies[][2] = { {0, 0}, {0, 16}, {1000, 0}, {10000, 16} };
+    for (const auto& policy : policies)
+    {
+        Async::ThreadPoolQueue::Options options;
+        options.spinCount = policy[0];
+        options.yieldCount = policy[1];
+        printf("%10u %10u %16.1f\n", policy[0], policy[1], roundTrip(options));
+    }
+}
+
+TEST_CASE("queue handle benchmark", "[.][Benchmark][QueueRefBenchmark]")
+{
+    const uint32_t numJobs = 1000000;
+    
+    // enqueue cost only, the queue has no workers
+    Async::Queue::Ptr queue = std::make_shared<Async::Queue>(Bench::BenchQueue);
+    Async::QueueRef ref = Async::registerQueue(queue);
+    auto measure = [&](const Async::QueueRef& target) {
+        Bench::Clock::time_point start = Bench::Clock::now();
+        for (uint32_t i=0; i<numJobs; i++)
+            target.enqueue([]() {});
+        std::chrono::duration<double, std::nano> elapsed = Bench::Clock::now() - start;
+        while (queue->runNext()) {}
+        return elapsed.count() / numJobs;
+    };
+    
+    printf("%10s %16s\n", "target", "ns/enqueue");
+    printf("%10s %16.1f\n", "id", measure(Async::QueueRef(Bench::BenchQueue)));
+    printf("%10s %16.1f\n", "handle", measure(ref));
+    Async::unregisterQueue(Bench::BenchQueue);
+}
+
+// Build once as is and once with ASYNC_OBSERVER defined (main.cpp then supplies a
+// counting observer) and compare: without an observer the hooks compile to
+// nothing, so this matches the numbers from before the hooks existed.
+TEST_CASE("instrumentation hooks benchmark", "[.][Benchmark][HooksBenchmark]")
+{
+    const uint32_t numJobs = 1000000;
+    const uint32_t numRounds = 5;
+    
+#ifdef ASYNC_OBSERVER
+    const char* observer = "counting";
+#else
+    const char* observer = "none";
+#endif
+    
+    // enqueue, dequeue, start and finish hooks on every job, best of numRounds
+    Async::Queue queue(Bench::BenchQueue);
+    double best = 0.0;
+    for (uint32_t round=0; round<numRounds; round++)
+    {
+        Bench::Clock::time_point start = Bench::Clock::now();
+        for (uint32_t i=0; i<numJobs; i++)
+        {
+            queue.enqueue([]() {});
+            queue.runNext();
+        }
+        std::chrono::duration<double, std::nano> elapsed = Bench::Clock::now() - start;
+        double perJob = elapsed.count() / numJobs;
+        if (round == 0 || perJob < best)
+            best = perJob;
+    }
+    
+    printf("%10s %16s\n", "observer", "ns/job");
+    printf("%10s %16.1f\n", observer, best);
+}
+
+TEST_CASE("reactor echo benchmark", "[.][Benchmark][ReactorBenchmark]")
+{
+    const uint32_t numRequests = 2000;
+    const uint32_t numThreads = std::max(2u, std::thread::hardware_concurrency());
+    
+    // every readiness wait is a task on the pool, which echoes and waits again
+    Async::ThreadPoolQueue::Ptr pool = std::make_shared<Async::ThreadPoolQueue>(Bench::BenchQueue, numThreads);
+    Async::registerQueue(pool);
+    std::atomic<uint32_t> closed(0);
+    std::function<void(int)> serveAsync = [&](int fd) {
+        Async::whenReadable(fd, Bench::BenchQueue).then([&, fd]() {
+            char buffer[Bench::EchoSize];
+            ssize_t n = read(fd, buffer, sizeof(buffer));
+            if (n > 0 && write(fd, buffer, n) == n)
+            {
+                serveAsync(fd);
+                return;
+            }
+            close(fd);
+            closed++;
+        });
+    };
+    
+    // a blocking thread per connection
+    std::vector<std::thread> servers;
+    auto serveBlocking = [&](int fd) {
+        servers.emplace_back([fd]() {
+            char buffer[Bench::EchoSize];
+            ssize_t n = 0;
+            while ((n = read(fd, buffer, sizeof(buffer))) > 0 && write(fd, buffer, n) == n) {}
+            close(fd);
+        });
+    };
+    
+    printf("%12s %16s %16s\n", "connections", "reactor req/s", "threads req/s");
+    for (uint32_t numConnections=1; numConnections<=256; numConnections*=4)
+    {
+        closed = 0;
+        double reactor = Bench::echoRequestRate(numConnections, numRequests, serveAsync);
+        while (closed < numConnections)
+            std::this_thread::yield();
+        
+        double threads = Bench::echoRequestRate(numConnections, numRequests, serveBlocking);
+        for (auto& server : servers)
+            server.join();
+        servers.clear();
+        
+        printf("%12u %16.0f %16.0f\n", numConnections, reactor, threads);
+    }
+    
+    Async::unregisterQueue(Bench::BenchQueue);
+}
+
+// reads come from the page cache, so this measures submission and completion
+// overhead rather than the device
+TEST_CASE("file I/O benchmark", "[.][Benchmark][FileIOBenchmark]")
+{
+    const size_t blockSize = 4096;
+    const size_t numBlocks = 16*1024;
+    const uint32_t numReads = 100000;
+    
+    char path[] = "/tmp/AsyncFileIOBenchXXXXXX";
+    int fd = mkstemp(path);
+    unlink(path);
+    std::vector<char> block(blockSize, 'x');
+    for (size_t i=0; i<numBlocks; i++)
+        pwrite(fd, block.data(), blockSize, i*blockSize);
+    
+    // keeps depth reads in flight, each completion issues the next one
+    auto measure = [&](Async::FileIO::Backend backend, uint32_t depth) {
+        Async::FileIO::Options options;
+        options.backend = backend;
+        Async::FileIO fileIO(options);
+        std::vector<std::vector<char>> buffers(depth, std::vector<char>(blockSize));
+        std::atomic<uint32_t> issued(0);
+        std::atomic<uint32_t> completed(0);
+        std::function<void(uint32_t)> issue = [&](uint32_t slot) {
+            uint32_t n = issued++;
+            if (n >= numReads)
+                return;
+            uint64_t offset = (n * 2654435761u % numBlocks) * blockSize;
+            fileIO.read(fd, offset, buffers[slot].data(), blockSize, [&, slot](size_t) {
+                // count last, the measuring thread may return as soon as it sees the count
+                issue(slot);
+                completed++;
+            });
+        };
+        
+        Bench::Clock::time_point start = Bench::Clock::now();
+        for (uint32_t slot=0; slot<depth; slot++)
+            issue(slot);
+        while (completed < numReads)
+            std::this_thread::yield();
+        std::chrono::duration<double> elapsed = Bench::Clock::now() - start;
+        return numReads / elapsed.count();
+    };
+    
+    printf("%8s %16s %16s\n", "depth", "io_uring reads/s", "threads reads/s");
+    for (uint32_t depth=1; depth<=256; depth*=4)
+    {
+        double ring = measure(Async::FileIO::Backend::IoUring, depth);
+        double threads = measure(Async::FileIO::Backend::Threads, depth);
+        printf("%8u %16.0f %16.0f\n", depth, ring, threads);
+    }
+    
+    close(fd);
+}
+
+#ifdef ASYNC_COROUTINES
+// only built as C++20 or later
+TEST_CASE("coroutine benchmark", "[.][Benchmark][CoroutineBenchmark]")
+{
+    const uint32_t numSteps = 100000;
+    
+    Async::ThreadPoolQueue::Ptr pool = std::make_shared<Async::ThreadPoolQueue>(Bench::BenchQueue, 2);
+    Async::registerQueue(pool);
+    auto measure = [numSteps](const std::function<int()>& pipeline) {
+        Bench::Clock::time_point start = Bench::Clock::now();
+        int result = pipeline();
+        std::chrono::duration<double, std::nano> elapsed = Bench::Clock::now() - start;
+        REQUIRE(result == static_cast<int>(numSteps));
+        return elapsed.count() / numSteps;
+    };
+    
+    // a continuation task per step
+    double then = measure([numSteps]() {
+        Async::Task<int> t = Async::CreateTask(Bench::BenchQueue, []() { return 0; });
+        for (uint32_t i=0; i<numSteps; i++)
+            t = t.then([](int x) { return x + 1; });
+        return t.get();
+    });
+    
+    // one coroutine awaiting a task per step
+    auto awaitSteps = [](uint32_t count) -> Async::Task<int> {
+        int x = 0;
+        for (uint32_t i=0; i<count; i++)
+            x = co_await Async::CreateTask(Bench::BenchQueue, [x]() { return x + 1; });
+        co_return x;
+    };
+    double await = measure([&]() { return awaitSteps(numSteps).get(); });
+    
+    // one coroutine hopping onto the queue for each step, no tasks at all
+    auto hopSteps = [](uint32_t count) -> Async::Task<int> {
+        int x = 0;
+        for (uint32_t i=0; i<count; i++)
+        {
+            co_await Async::resumeOn(Bench::BenchQueue);
+            x++;
+        }
+        co_return x;
+    };
+    double hop = measure([&]() { return hopSteps(numSteps).get(); });
+    
+    printf("%16s %16s %16s\n", "then ns/step", "await ns/step", "resumeOn ns/step");
+    printf("%16.1f %16.1f %16.1f\n", then, await, hop);
+    
+    // workers may still hold the pool through the registry for a moment after the
+    // last step, let them finish before dropping it
+    pool->drain(Bench::Clock::time_point::max());
+    Async::unregisterQueue(Bench::BenchQueue);
+}
+#endif
+
+TEST_CASE("when all benchmark", "[.][Benchmark][WhenAllBenchmark]")
+{
+    const uint32_t numGroups = 100;
+    const uint32_t tasksPerGroup = 100;
+    
+    // nested fan-in on a small pool, every group has its own WhenAll
+    Async::ThreadPoolQueue::Ptr pool = std::make_shared<Async::ThreadPoolQueue>(Bench::BenchQueue, 4);
+    Async::registerQueue(pool);
+    
+    Bench::Clock::time_point start = Bench::Clock::now();
+    std::vector<Async::Task<size_t>> groups;
+    for (uint32_t g=0; g<numGroups; g++)
+    {
+        std::vector<Async::Task<uint32_t>> tasks = Async::CreateTasks(Bench::BenchQueue, tasksPerGroup, [](size_t i) {
+            return static_cast<uint32_t>(i);
+        });
+        groups.push_back(Async::WhenAll(Bench::BenchQueue, tasks.begin(), tasks.end()).then([](std::vector<Async::Task<uint32_t>> completed) {
+            return completed.size();
+        }));
+    }
+    size_t total = 0;
+    for (auto& group : Async::WhenAll(Bench::BenchQueue, groups.begin(), groups.end()).get())
+        total += group.get();
+    std::chrono::duration<double, std::micro> elapsed = Bench::Clock::now() - start;
+    REQUIRE(total == numGroups * tasksPerGroup);
+    
+    printf("%10s %10s %16s\n", "groups", "tasks", "us total");
+    printf("%10u %10u %16.1f\n", numGroups, numGroups * tasksPerGroup, elapsed.count());
+    
+    pool->drain(Bench::Clock::time_point::max());
+    Async::unregisterQueue(Bench::BenchQueue);
+}
+
+TEST_CASE("when any benchmark", "[.][Benchmark][WhenAnyBenchmark]")
+{
+    const uint32_t numRequests = 1000;
+    const uint32_t numHedges = 4;
+    
+    // hedged requests: each fans out to numHedges replicas and takes the first answer
+    Async::ThreadPoolQueue::Ptr pool = std::make_shared<Async::ThreadPoolQueue>(Bench::BenchQueue, 4);
+    Async::registerQueue(pool);
+    
+    Bench::Clock::time_point start = Bench::Clock::now();
+    std::vector<Async::Task<uint32_t>> answers;
+    for (uint32_t r=0; r<numRequests; r++)
+    {
+        std::vector<Async::Task<uint32_t>> replicas = Async::CreateTasks(Bench::BenchQueue, numHedges, [r](size_t) {
+            return r;
+        });
+        answers.push_back(Async::WhenAny(Bench::BenchQueue, replicas.begin(), replicas.end()).then([](std::vector<Async::Task<uint32_t>> first) {
+            return first.front().get();
+        }));
+    }
+    uint64_t total = 0;
+    for (auto& answer : answers)
+        total += answer.get();
+    std::chrono::duration<double, std::micro> elapsed = Bench::Clock::now() - start;
+    REQUIRE(total == static_cast<uint64_t>(numRequests) * (numRequests - 1) / 2);
+    
+    printf("%10s %10s %16s\n", "requests", "hedges", "us/request");
+    printf("%10u %10u %16.2f\n", numRequests, numHedges, elapsed.count() / numRequests);
+    
+    pool->drain(Bench::Clock::time_point::max());
+    Async::unregisterQueue(Bench::BenchQueue);
+}
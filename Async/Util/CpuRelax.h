@@ -0,0 +1,24 @@
+#pragma once
+
+#include "Util/Base.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+UTIL_BEGIN
+
+// hint to the cpu that we're in a spin-wait loop (x86 pause / arm yield), which
+// saves power and frees pipeline resources for a sibling hyperthread
+inline void cpuRelax()
+{
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+    _mm_pause();
+#elif defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+UTIL_END
@@ -0,0 +1,178 @@
+#pragma once
+
+#include "Util/Base.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+UTIL_BEGIN
+
+// Bounded lock-free multi-producer/multi-consumer ring buffer (after Dmitry Vyukov).
+// Every slot carries a sequence number, so producers and consumers only contend on
+// the head/tail counters, each of which sits on its own cache line.
+//
+// Elements are addressed by the position returned from tryPush() and can be revoked
+// while still in the buffer. A revoked element is still handed to the consumer that
+// pops it (flagged as revoked), so its destruction happens outside the buffer.
+template <typename T>
+class MPMCRingBufferT
+{
+public:
+    static const size_t CacheLineSize = 64;
+    
+    explicit MPMCRingBufferT(size_t capacity)
+    {
+        size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+        
+        m_mask = size - 1;
+        m_slots.reset(new Slot[size]);
+        for (size_t i=0; i<size; i++)
+            m_slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    
+    MPMCRingBufferT(const MPMCRingBufferT&) = delete;
+    MPMCRingBufferT& operator=(const MPMCRingBufferT&) = delete;
+    
+    size_t capacity() const
+    {
+        return m_mask + 1;
+    }
+    
+    // approximate when called concurrently with push/pop
+    size_t size() const
+    {
+        uint64_t head = m_head.value.load(std::memory_order_acquire);
+        uint64_t tail = m_tail.value.load(std::memory_order_acquire);
+        return (tail > head) ? static_cast<size_t>(tail - head) : 0;
+    }
+    
+    bool empty() const
+    {
+        return size() == 0;
+    }
+    
+    // total number of positions ever reserved by producers
+    uint64_t tail() const
+    {
+        return m_tail.value.load(std::memory_order_acquire);
+    }
+    
+    // moves value into the buffer, returns false (leaving value untouched) when full
+    bool tryPush(T&& value, uint64_t& pos)
+    {
+        Slot* slot = nullptr;
+        pos = m_tail.value.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            slot = &m_slots[pos & m_mask];
+            uint64_t seq = slot->sequence.load(std::memory_order_acquire);
+            int64_t diff = static_cast<int64_t>(seq - pos);
+            if (diff == 0)
+            {
+                if (m_tail.value.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = m_tail.value.load(std::memory_order_relaxed);
+            }
+        }
+        
+        slot->value = std::move(value);
+        slot->tag.store(pos + 1, std::memory_order_relaxed);
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+    
+    // reserves count consecutive positions starting at the returned one, each of
+    // which must then be filled with publish(). unlike tryPush this never fails,
+    // a full buffer makes publish() wait for consumers instead
+    uint64_t reserve(size_t count)
+    {
+        return m_tail.value.fetch_add(count, std::memory_order_relaxed);
+    }
+    
+    // fills a position obtained from reserve(), returns false if the slot is still
+    // occupied from the previous lap (the caller should back off and retry)
+    bool tryPublish(uint64_t pos, T&& value)
+    {
+        Slot& slot = m_slots[pos & m_mask];
+        if (slot.sequence.load(std::memory_order_acquire) != pos)
+            return false;
+        
+        slot.value = std::move(value);
+        slot.tag.store(pos + 1, std::memory_order_relaxed);
+        slot.sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+    
+    // returns false when empty, otherwise moves the oldest element into value
+    bool tryPop(T& value, uint64_t& pos, bool& revoked)
+    {
+        Slot* slot = nullptr;
+        pos = m_head.value.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            slot = &m_slots[pos & m_mask];
+            uint64_t seq = slot->sequence.load(std::memory_order_acquire);
+            int64_t diff = static_cast<int64_t>(seq - (pos + 1));
+            if (diff == 0)
+            {
+                if (m_head.value.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = m_head.value.load(std::memory_order_relaxed);
+            }
+        }
+        
+        revoked = (slot->tag.exchange(0, std::memory_order_acq_rel) == 0);
+        value = std::move(slot->value);
+        slot->sequence.store(pos + m_mask + 1, std::memory_order_release);
+        return true;
+    }
+    
+    // marks the element pushed at pos as revoked if it has not been popped yet
+    bool revoke(uint64_t pos)
+    {
+        Slot& slot = m_slots[pos & m_mask];
+        uint64_t expected = pos + 1;
+        return slot.tag.compare_exchange_strong(expected, 0, std::memory_order_acq_rel);
+    }
+    
+private:
+    struct Slot
+    {
+        std::atomic<uint64_t> sequence;
+        std::atomic<uint64_t> tag{0}; // pos + 1 while live, 0 once popped or revoked
+        T value;
+    };
+    
+    // padded rather than aligned, so the buffer needs no over-aligned allocation
+    struct PaddedCounter
+    {
+        std::atomic<uint64_t> value{0};
+        char padding[CacheLineSize - sizeof(std::atomic<uint64_t>)];
+    };
+    
+    char m_padding[CacheLineSize];
+    PaddedCounter m_head;
+    PaddedCounter m_tail;
+    size_t m_mask = 0;
+    std::unique_ptr<Slot[]> m_slots;
+};
+
+UTIL_END
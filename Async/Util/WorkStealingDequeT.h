@@ -0,0 +1,146 @@
+#pragma once
+
+#include "Util/Base.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+UTIL_BEGIN
+
+// Chase-Lev work-stealing deque (with the C11 orderings from Le, Pop, Cohen & Nardelli).
+// The owning thread pushes and takes at the bottom (LIFO), any other thread may steal
+// from the top (FIFO). T must be trivially copyable, typically a pointer, since thieves
+// read elements that may be concurrently overwritten before their CAS fails.
+//
+// The circular array grows on demand; retired arrays are kept until destruction so a
+// thief still reading from an old array never touches freed memory.
+template <typename T>
+class WorkStealingDequeT
+{
+public:
+    explicit WorkStealingDequeT(size_t capacity = 256)
+    {
+        size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+        
+        m_arrays.emplace_back(new Array(size));
+        m_array.store(m_arrays.back().get(), std::memory_order_relaxed);
+    }
+    
+    WorkStealingDequeT(const WorkStealingDequeT&) = delete;
+    WorkStealingDequeT& operator=(const WorkStealingDequeT&) = delete;
+    
+    // approximate when called concurrently with push/take/steal
+    bool empty() const
+    {
+        int64_t b = m_bottom.load(std::memory_order_acquire);
+        int64_t t = m_top.load(std::memory_order_acquire);
+        return b <= t;
+    }
+    
+    // owner thread only
+    void push(T value)
+    {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_acquire);
+        Array* a = m_array.load(std::memory_order_relaxed);
+        if (b - t > static_cast<int64_t>(a->size) - 1)
+            a = grow(a, b, t);
+        
+        a->put(b, value);
+        m_bottom.store(b + 1, std::memory_order_release);
+    }
+    
+    // owner thread only
+    bool take(T& value)
+    {
+        int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+        Array* a = m_array.load(std::memory_order_relaxed);
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+        
+        if (t > b)
+        {
+            // deque was already empty
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        
+        value = a->get(b);
+        if (t == b)
+        {
+            // last element, race against thieves for it
+            bool won = m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        
+        return true;
+    }
+    
+    // any thread, returns false when empty or when losing a race with another thread
+    bool steal(T& value)
+    {
+        int64_t t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = m_bottom.load(std::memory_order_acquire);
+        if (t >= b)
+            return false;
+        
+        Array* a = m_array.load(std::memory_order_acquire);
+        T candidate = a->get(t);
+        if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return false;
+        
+        value = candidate;
+        return true;
+    }
+    
+private:
+    struct Array
+    {
+        explicit Array(size_t size0)
+            : size(size0)
+            , mask(size0 - 1)
+            , elements(new std::atomic<T>[size0])
+        {
+        }
+        
+        T get(int64_t i) const
+        {
+            return elements[static_cast<size_t>(i) & mask].load(std::memory_order_relaxed);
+        }
+        
+        void put(int64_t i, T value)
+        {
+            elements[static_cast<size_t>(i) & mask].store(value, std::memory_order_relaxed);
+        }
+        
+        size_t size;
+        size_t mask;
+        std::unique_ptr<std::atomic<T>[]> elements;
+    };
+    
+    Array* grow(Array* a, int64_t b, int64_t t)
+    {
+        Array* bigger = new Array(a->size * 2);
+        for (int64_t i=t; i<b; i++)
+            bigger->put(i, a->get(i));
+        
+        m_arrays.emplace_back(bigger);
+        m_array.store(bigger, std::memory_order_release);
+        return bigger;
+    }
+    
+    std::atomic<int64_t> m_top{0};
+    std::atomic<int64_t> m_bottom{0};
+    std::atomic<Array*> m_array{nullptr};
+    std::vector<std::unique_ptr<Array>> m_arrays; // owner thread only
+};
+
+UTIL_END
@@ -1,12 +1,23 @@
+#include "Async/Coroutine.h"
+#include "Async/FileIO.h"
 #include "Async/Task.h"
+#include "Async/Timer.h"
 
 #define CATCH_CONFIG_RUNNER
 #include "catch.hpp"
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <cassert>
+#include <cerrno>
 #include <cmath>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <unistd.h>
 
 
 namespace Test
@@ -14,8 +25,45 @@ namespace Test
     const uint32_t TestQueue1 = 444;
     const uint32_t TestQueue2 = 999;
     const uint32_t NumThreads = 4;
+    
+    // a job that can only be moved, never copied
+    struct MoveOnlyJob
+    {
+        std::unique_ptr<int> value;
+        std::atomic_int* sum;
+        
+        void operator()()
+        {
+            *sum += *value;
+        }
+    };
+}
+
+#ifdef ASYNC_OBSERVER
+// the application side of the compile-time hooks, see Async/Hooks.h
+namespace Test
+{
+    std::atomic<uint64_t> numEnqueued(0);
+    std::atomic<uint64_t> numDequeued(0);
+    std::atomic<uint64_t> numStarted(0);
+    std::atomic<uint64_t> numFinished(0);
+    std::atomic<uint64_t> numCanceled(0);
+    std::atomic<uint64_t> numTasksCompleted(0);
 }
 
+void Async::Observer::onEnqueue(uint64_t) { Test::numEnqueued.fetch_add(1, std::memory_order_relaxed); }
+void Async::Observer::onDequeue(uint64_t) { Test::numDequeued.fetch_add(1, std::memory_order_relaxed); }
+void Async::Observer::onStart(uint64_t) { Test::numStarted.fetch_add(1, std::memory_order_relaxed); }
+void Async::Observer::onFinish(uint64_t) { Test::numFinished.fetch_add(1, std::memory_order_relaxed); }
+void Async::Observer::onCancel(uint64_t) { Test::numCanceled.fetch_add(1, std::memory_order_relaxed); }
+
+void Async::Observer::onTaskTransition(const void*, TaskEvent event)
+{
+    if (event == TaskEvent::Completed)
+        Test::numTasksCompleted.fetch_add(1, std::memory_order_relaxed);
+}
+#endif
+
 void setupQueues()
 {
     Async::ThreadPoolQueue::Ptr queue1 = std::make_shared<Async::ThreadPoolQueue>(Test::TestQueue1, Test::NumThreads);
@@ -246,6 +294,26 @@ TEST_CASE("when any", "[WhenAny]")
     t0.get();
     t1.get();
     t2.get();
+    
+    // the first completion settles it, no thread waits even on a single worker
+    Async::ThreadPoolQueue::Ptr single = std::make_shared<Async::ThreadPoolQueue>(Test::TestQueue1 + 31, 1);
+    Async::registerQueue(single);
+    std::atomic_bool open(false);
+    Async::Task<void> gate = Async::CreateTask(Test::TestQueue2, [&open]() {
+        while (!open)
+            std::this_thread::yield();
+    });
+    Async::Task<int> first = gate.then(Test::TestQueue1 + 31, []() { return 1; });
+    Async::Task<int> second = first.then(Test::TestQueue1 + 31, [](int) { return 2; });
+    auto hedged = {second, first};
+    auto anyTask2 = Async::WhenAny(Test::TestQueue1 + 31, begin(hedged), end(hedged));
+    open = true;
+    std::vector<Async::Task<int>> winners = anyTask2.get();
+    REQUIRE(winners.size() == 1);
+    REQUIRE(winners[0].get() == 1);
+    REQUIRE(second.get() == 2);
+    single->drain(std::chrono::steady_clock::time_point::max());
+    REQUIRE(Async::unregisterQueue(Test::TestQueue1 + 31));
 }
 
 TEST_CASE("when all", "[WhenAll]")
@@ -278,6 +346,26 @@ TEST_CASE("when all", "[WhenAll]")
     t0.get();
     t1.get();
     t2.get();
+    
+    // waiting takes no thread, so it works on a single worker that the inputs need too
+    Async::ThreadPoolQueue::Ptr single = std::make_shared<Async::ThreadPoolQueue>(Test::TestQueue1 + 30, 1);
+    Async::registerQueue(single);
+    std::atomic_bool open(false);
+    Async::Task<void> gate = Async::CreateTask(Test::TestQueue2, [&open]() {
+        while (!open)
+            std::this_thread::yield();
+    });
+    std::vector<Async::Task<void>> inputs;
+    for (int i=0; i<3; i++)
+        inputs.push_back(gate.then(Test::TestQueue1 + 30, []() {}));
+    auto allInputs = Async::WhenAll(Test::TestQueue1 + 30, inputs.begin(), inputs.end());
+    open = true;
+    REQUIRE(allInputs.get().size() == inputs.size());
+    
+    std::vector<Async::Task<void>> none;
+    REQUIRE(Async::WhenAll(Test::TestQueue1 + 30, none.begin(), none.end()).get().empty());
+    single->drain(std::chrono::steady_clock::time_point::max());
+    REQUIRE(Async::unregisterQueue(Test::TestQueue1 + 30));
 }
 
 TEST_CASE("when any operator", "[WhenAnyOperator]")
@@ -302,7 +390,37 @@ TEST_CASE("when any operator", "[WhenAnyOperator]")
     
     // make sure all tasks are completed before returning from this func
     t1.get();
-    t2.get();
+    t2.get();    
+    // the combined task is completed in place but still carries its queue and
+    // priority, so continuations that name no queue run there
+    std::atomic_bool open(false);
+    Async::Task<int> a = Async::CreateTask(Test::TestQueue1, [&open]() {
+        while (!open)
+            std::this_thread::yield();
+        return 1;
+    }, 1);
+    Async::Task<int> b = Async::CreateTask(Test::TestQueue1, [&open]() {
+        while (!open)
+            std::this_thread::yield();
+        return 2;
+    }, 1);
+    auto either = a || b;
+    REQUIRE(either.getQueueId() == Test::TestQueue1);
+    REQUIRE(either.getPriority() == 1);
+    auto first = either.then([](std::vector<Async::Task<int>> done) {
+        return done[0].get();
+    });
+    auto nested = (either || (b || a)).then([](std::vector<Async::Task<std::vector<Async::Task<int>>>> done) {
+        return done.size();
+    });
+    REQUIRE(first.getQueueId() == Test::TestQueue1);
+    REQUIRE(nested.getQueueId() == Test::TestQueue1);
+    open = true;
+    int winner = first.get();
+    REQUIRE((winner == 1 || winner == 2));
+    REQUIRE(nested.get() == 1);
+    a.get();
+    b.get();
 }
 
 TEST_CASE("when all operator", "[WhenAllOperator]")
@@ -328,6 +446,32 @@ TEST_CASE("when all operator", "[WhenAllOperator]")
     // make sure all tasks are completed before returning from this func
     t1.get();
     t2.get();
+    
+    // the combined task knows its queue and priority before it is enqueued, so
+    // continuations that name no queue run there
+    std::atomic_bool open(false);
+    Async::Task<int> a = Async::CreateTask(Test::TestQueue1, [&open]() {
+        while (!open)
+            std::this_thread::yield();
+        return 1;
+    }, 1);
+    Async::Task<int> b = Async::CreateTask(Test::TestQueue1, []() { return 2; }, 1);
+    auto both = a && b;
+    REQUIRE(both.getQueueId() == Test::TestQueue1);
+    REQUIRE(both.getPriority() == 1);
+    auto sum = both.then([](std::vector<Async::Task<int>> done) {
+        return done[0].get() + done[1].get();
+    });
+    auto nested = (both && (b && a)).then([](std::vector<Async::Task<std::vector<Async::Task<int>>>> done) {
+        return done.size();
+    });
+    auto none = Async::WhenAll(Test::TestQueue2, &a, &a, 1);
+    REQUIRE(sum.getQueueId() == Test::TestQueue1);
+    REQUIRE(none.getQueueId() == Test::TestQueue2);
+    open = true;
+    REQUIRE(sum.get() == 3);
+    REQUIRE(nested.get() == 2);
+    REQUIRE(none.then([]() { return 4; }).get() == 4);
 }
 
 TEST_CASE("large number of tasks", "[LargeNumberOfTasks]")
@@ -382,6 +526,1235 @@ TEST_CASE("large number of tasks on multiple queues", "[LargeNumberOfTasksMultip
     REQUIRE(completed.size() == numTasks);
 }
 
+TEST_CASE("ring buffer queue storage", "[RingBufferQueue]")
+{
+    Async::ThreadPoolQueue::Options options;
+    options.storage = Async::Queue::Storage::RingBuffer;
+    options.capacity = 8;
+    
+    // jobs that are canceled while in the ring are skipped by runNext
+    Async::Queue queue(Test::TestQueue1 + 1, options);
+    REQUIRE(queue.getStorage() == Async::Queue::Storage::RingBuffer);
+    
+    std::vector<int> ran;
+    uint64_t job0 = queue.enqueue([&ran]() { ran.push_back(0); });
+    uint64_t job1 = queue.enqueue([&ran]() { ran.push_back(1); });
+    uint64_t job2 = queue.enqueue([&ran]() { ran.push_back(2); });
+    REQUIRE(job0 != job1);
+    REQUIRE(queue.cancel(job1));
+    REQUIRE(!queue.cancel(job1));
+    
+    while (queue.runNext()) {}
+    REQUIRE(ran == std::vector<int>({0, 2}));
+    REQUIRE(queue.empty());
+    REQUIRE(!queue.cancel(job2));
+    
+    // job counters start over at 1, never 0, when they wrap
+    const uint64_t lastCounter = (1u << 29) - 1;
+    REQUIRE(Async::Queue::offsetJobId(job0 | lastCounter, 1) == ((job0 & ~lastCounter) | 1));
+    
+    // many producers wrapping a small ring several times
+    const uint32_t numProducers = 8;
+    const uint32_t jobsPerProducer = 1000;
+    std::atomic<uint32_t> count(0);
+    {
+        Async::ThreadPoolQueue pool(Test::TestQueue1 + 2, Test::NumThreads, options);
+        std::vector<std::thread> producers;
+        for (uint32_t i=0; i<numProducers; i++)
+        {
+            producers.emplace_back([&pool, &count]() {
+                for (uint32_t j=0; j<jobsPerProducer; j++)
+                    pool.enqueue([&count]() { ++count; });
+            });
+        }
+        
+        for (auto& producer : producers)
+            producer.join();
+        
+        while (count < numProducers*jobsPerProducer)
+            std::this_thread::yield();
+    }
+    REQUIRE(count == numProducers*jobsPerProducer);
+}
+
+TEST_CASE("work stealing thread pool", "[WorkStealing]")
+{
+    const uint32_t queueId = Test::TestQueue1 + 3;
+    Async::ThreadPoolQueue::Options options;
+    options.workStealing = true;
+    Async::ThreadPoolQueue::Ptr queue = std::make_shared<Async::ThreadPoolQueue>(queueId, Test::NumThreads, options);
+    Async::registerQueue(queue);
+    
+    // binary fan-out, every job enqueues its children from a worker thread
+    const int depth = 12;
+    std::atomic_int count(0);
+    std::function<void(int)> spawn = [&spawn, &count, queueId](int d) {
+        ++count;
+        if (d == 0)
+            return;
+        
+        Async::enqueue(queueId, [&spawn, d]() { spawn(d - 1); });
+        Async::enqueue(queueId, [&spawn, d]() { spawn(d - 1); });
+    };
+    Async::enqueue(queueId, [&spawn, depth]() { spawn(depth); });
+    
+    const int expected = (1 << (depth + 1)) - 1;
+    while (count < expected)
+        std::this_thread::yield();
+    REQUIRE(count == expected);
+    
+    // jobs kept on a worker deque still carry the queue id
+    Async::Task<uint32_t> outer = Async::CreateTask(queueId, [queueId]() {
+        uint64_t jobId = Async::enqueue(queueId, []() {});
+        return static_cast<uint32_t>(jobId >> 32);
+    });
+    REQUIRE(outer.get() == queueId);
+    
+    queue->stop();
+    Async::unregisterQueue(queueId);
+}
+
+TEST_CASE("move-only jobs", "[MoveOnlyJobs]")
+{
+    // small closures are stored inline, large ones fall back to the heap
+    Async::JobFunc small([]() {});
+    REQUIRE(small.isInline());
+    
+    std::array<char, Async::JobFunc::InlineSize + 1> big = {{}};
+    Async::JobFunc large([big]() { (void)big; });
+    REQUIRE(!large.isInline());
+    
+    Async::JobFunc moved(std::move(small));
+    REQUIRE(moved);
+    REQUIRE(!small);
+    
+    // empty callables make empty jobs
+    void (*nullFunction)() = nullptr;
+    REQUIRE(!Async::JobFunc(nullFunction));
+    REQUIRE(!Async::JobFunc(std::function<void()>()));
+    REQUIRE(Async::JobFunc(std::function<void()>([]() {})));
+    
+    // and are rejected at enqueue, with or without asserts
+    Async::Queue rejecting(Test::TestQueue1 + 35);
+    REQUIRE(rejecting.enqueue(std::function<void()>()) == 0);
+    std::vector<std::function<void()>> withEmpty = { []() {}, std::function<void()>() };
+    REQUIRE(rejecting.enqueueBulk(withEmpty.begin(), withEmpty.end()) == 0);
+    REQUIRE(rejecting.empty());
+    REQUIRE(rejecting.stats().numRejected == 3);
+    
+    std::atomic_int sum(0);
+    
+    Async::Queue queue(Test::TestQueue1 + 4);
+    Test::MoveOnlyJob job1;
+    job1.value.reset(new int(5));
+    job1.sum = &sum;
+    queue.enqueue(std::move(job1));
+    while (queue.runNext()) {}
+    REQUIRE(sum == 5);
+    
+    Test::MoveOnlyJob job2;
+    job2.value.reset(new int(7));
+    job2.sum = &sum;
+    REQUIRE(Async::enqueue(Test::TestQueue1, std::move(job2)) != 0);
+    while (sum != 12)
+        std::this_thread::yield();
+}
+
+TEST_CASE("cancel queued jobs", "[CancelJobs]")
+{
+    const uint32_t numJobs = 1000;
+    
+    Async::Queue queue(Test::TestQueue1 + 5);
+    std::vector<uint64_t> jobIds;
+    std::vector<uint32_t> ran;
+    for (uint32_t i=0; i<numJobs; i++)
+    {
+        uint64_t jobId = queue.enqueue([&ran, i]() { ran.push_back(i); });
+        jobIds.push_back(jobId);
+    }
+    
+    // cancel the front, the back and every odd job in between
+    REQUIRE(queue.cancel(jobIds.front()));
+    REQUIRE(queue.cancel(jobIds.back()));
+    for (uint32_t i=1; i<numJobs-1; i+=2)
+        REQUIRE(queue.cancel(jobIds[i]));
+    
+    REQUIRE(!queue.cancel(jobIds.front()));
+    REQUIRE(!queue.cancel(jobIds[1]));
+    REQUIRE(!queue.cancel(jobIds.back() + 1));
+    
+    while (queue.runNext()) {}
+    REQUIRE(ran.size() == numJobs/2 - 1);
+    for (size_t i=0; i<ran.size(); i++)
+        REQUIRE(ran[i] == 2*(i + 1));
+    REQUIRE(queue.empty());
+    
+    // canceling every queued job leaves the queue empty
+    uint64_t a = queue.enqueue([]() {});
+    uint64_t b = queue.enqueue([]() {});
+    REQUIRE(queue.cancel(b));
+    REQUIRE(!queue.empty());
+    REQUIRE(queue.cancel(a));
+    REQUIRE(queue.empty());
+    REQUIRE(!queue.runNext());
+}
+
+TEST_CASE("bulk enqueue", "[BulkEnqueue]")
+{
+    const uint32_t numJobs = 100;
+    
+    std::vector<uint32_t> ran;
+    std::vector<std::function<void()>> funcs;
+    for (uint32_t i=0; i<numJobs; i++)
+        funcs.push_back([&ran, i]() { ran.push_back(i); });
+    
+    // bulk jobs get consecutive ids and keep their order
+    Async::Queue queue(Test::TestQueue1 + 6);
+    uint64_t firstJobId = queue.enqueueBulk(funcs.begin(), funcs.end());
+    REQUIRE(firstJobId != 0);
+    REQUIRE(queue.cancel(Async::Queue::offsetJobId(firstJobId, 10)));
+    REQUIRE(queue.enqueueBulk(funcs.end(), funcs.end()) == 0);
+    
+    while (queue.runNext()) {}
+    REQUIRE(ran.size() == numJobs - 1);
+    REQUIRE(ran[9] == 9);
+    REQUIRE(ran[10] == 11);
+    
+    // through the registry
+    std::atomic_int count(0);
+    std::vector<std::function<void()>> counters(numJobs, [&count]() { ++count; });
+    REQUIRE(Async::enqueueBulk(Test::TestQueue1, counters.begin(), counters.end()) != 0);
+    while (count != numJobs)
+        std::this_thread::yield();
+    
+    // bulk larger than a ring buffer's capacity
+    Async::ThreadPoolQueue::Options ringOptions;
+    ringOptions.storage = Async::Queue::Storage::RingBuffer;
+    ringOptions.capacity = 8;
+    {
+        Async::ThreadPoolQueue pool(Test::TestQueue1 + 7, Test::NumThreads, ringOptions);
+        count = 0;
+        REQUIRE(pool.enqueueBulk(counters.begin(), counters.end()) != 0);
+        while (count != numJobs)
+            std::this_thread::yield();
+    }
+    
+    // a batch of tasks submitted at once
+    std::vector<Async::Task<size_t>> tasks = Async::CreateTasks(Test::TestQueue1, numJobs, [](size_t i) {
+        return i*i;
+    });
+    REQUIRE(tasks.size() == numJobs);
+    for (size_t i=0; i<tasks.size(); i++)
+    {
+        REQUIRE(tasks[i].get() == i*i);
+        REQUIRE(tasks[i].getQueueId() == Test::TestQueue1);
+    }
+    
+    auto squares = Async::WhenAll(Test::TestQueue2, tasks.begin(), tasks.end()).get();
+    REQUIRE(squares.size() == numJobs);
+}
+
+TEST_CASE("priority bands", "[Priorities]")
+{
+    Async::Queue::Options options;
+    options.numPriorities = 3;
+    options.agingLimit = 0;
+    
+    std::string ran;
+    auto job = [&ran](char c) {
+        return [&ran, c]() { ran.push_back(c); };
+    };
+    
+    // strict priority order, FIFO within a band
+    Async::Queue strict(Test::TestQueue1 + 8, options);
+    REQUIRE(strict.getNumPriorities() == 3);
+    strict.enqueue(job('a'), 2);
+    strict.enqueue(job('b'), 99); // clamped to the lowest band
+    strict.enqueue(job('c'), 1);
+    uint64_t canceled = strict.enqueue(job('x'), 1);
+    strict.enqueue(job('d'), 0);
+    strict.enqueue(job('e'), 0);
+    REQUIRE(strict.cancel(canceled));
+    while (strict.runNext()) {}
+    REQUIRE(ran == "decab");
+    
+    // with aging a waiting low band gets served every agingLimit dequeues
+    options.agingLimit = 2;
+    Async::Queue aging(Test::TestQueue1 + 9, options);
+    ran.clear();
+    aging.enqueue(job('l'), 2);
+    for (int i=0; i<5; i++)
+        aging.enqueue(job('h'), 0);
+    while (aging.runNext()) {}
+    REQUIRE(ran == "hlhhhh");
+    
+    // tasks pass their priority on to continuations unless told otherwise
+    Async::Task<int> t = Async::CreateTask(Test::TestQueue1, []() { return 1; }, 2);
+    Async::Task<int> inherited = t.then([](int x) { return x + 1; });
+    Async::Task<int> overridden = inherited.then(Test::TestQueue1, [](int x) { return x + 1; }, 1);
+    REQUIRE(t.getPriority() == 2);
+    REQUIRE(inherited.getPriority() == 2);
+    REQUIRE(overridden.getPriority() == 1);
+    REQUIRE(overridden.get() == 3);
+}
+
+TEST_CASE("timers", "[Timers]")
+{
+    typedef std::chrono::milliseconds ms;
+    
+    // one-shot timers fire no earlier than requested
+    std::atomic_int fired(0);
+    Async::TimerClock::time_point start = Async::TimerClock::now();
+    std::atomic<int64_t> delayMs(-1);
+    Async::enqueueAfter(Test::TestQueue1, ms(50), [&]() {
+        delayMs = std::chrono::duration_cast<ms>(Async::TimerClock::now() - start).count();
+        fired++;
+    });
+    Async::enqueueAt(Test::TestQueue1, start + ms(20), [&fired]() { fired++; });
+    
+    // canceled before its deadline, never runs
+    std::atomic_int canceledRuns(0);
+    uint64_t canceled = Async::enqueueAfter(Test::TestQueue1, ms(30), [&canceledRuns]() { canceledRuns++; });
+    REQUIRE((canceled >> 32) == Async::TimerQueueId);
+    REQUIRE(Async::cancel(canceled));
+    REQUIRE(!Async::cancel(canceled));
+    
+    // periodic timers keep firing until canceled
+    std::atomic_int ticks(0);
+    uint64_t periodic = Async::enqueueEvery(Test::TestQueue1, ms(5), [&ticks]() { ticks++; });
+    
+    while (fired < 2 || ticks < 3)
+        std::this_thread::sleep_for(ms(1));
+    
+    REQUIRE(delayMs >= 50);
+    REQUIRE(Async::cancel(periodic));
+    std::this_thread::sleep_for(ms(20)); // let firings already handed to the pool finish
+    int ticksAfterCancel = ticks;
+    std::this_thread::sleep_for(ms(30));
+    REQUIRE(ticks == ticksAfterCancel);
+    REQUIRE(canceledRuns == 0);
+    REQUIRE(Async::Details::numPendingTimers() == 0);
+    
+    // a full bounded queue runs due jobs on the timer thread, which can schedule more timers
+    Async::Queue::Options options;
+    options.maxJobs = 1;
+    options.overflow = Async::Queue::Overflow::RunOnCaller;
+    Async::Queue::Ptr running = std::make_shared<Async::Queue>(Test::TestQueue1 + 32, options);
+    Async::registerQueue(running);
+    running->enqueue([]() {});
+    std::atomic_int rescheduled(0);
+    std::function<void()> reschedule = [&]() {
+        if (++rescheduled < 3)
+            Async::enqueueAfter(Test::TestQueue1 + 32, ms(1), reschedule);
+    };
+    Async::enqueueAfter(Test::TestQueue1 + 32, ms(1), reschedule);
+    while (rescheduled < 3)
+        std::this_thread::sleep_for(ms(1));
+    running->clear();
+    
+    // while a due job waits for room in a blocking queue, timers can still be added and canceled
+    options.overflow = Async::Queue::Overflow::Block;
+    Async::Queue::Ptr blocking = std::make_shared<Async::Queue>(Test::TestQueue1 + 33, options);
+    Async::registerQueue(blocking);
+    std::atomic_int blockedRuns(0);
+    blocking->enqueue([]() {});
+    Async::enqueueAfter(Test::TestQueue1 + 33, ms(1), [&blockedRuns]() { blockedRuns++; });
+    std::this_thread::sleep_for(ms(20));
+    REQUIRE(Async::cancel(Async::enqueueAfter(Test::TestQueue1, ms(30), []() {})));
+    REQUIRE(blocking->runNext());
+    while (Async::Details::numPendingTimers() != 0 || !blocking->runNext())
+        std::this_thread::yield();
+    REQUIRE(blockedRuns == 1);
+    REQUIRE(Async::unregisterQueue(Test::TestQueue1 + 32));
+    REQUIRE(Async::unregisterQueue(Test::TestQueue1 + 33));
+}
+
+TEST_CASE("serial queues", "[SerialQueues]")
+{
+    const uint32_t numQueues = 200;
+    const uint32_t jobsPerQueue = 100;
+    
+    // many serial queues sharing one pool, each must run its jobs one at a time in order
+    Async::Queue::Ptr pool = Async::getQueue(Test::TestQueue1);
+    std::vector<Async::SerialQueue::Ptr> queues;
+    std::vector<std::vector<uint32_t>> ran(numQueues);
+    std::unique_ptr<std::atomic_int[]> running(new std::atomic_int[numQueues]);
+    std::atomic_int overlaps(0);
+    std::atomic_int done(0);
+    for (uint32_t q=0; q<numQueues; q++)
+    {
+        running[q] = 0;
+        queues.push_back(std::make_shared<Async::SerialQueue>(Test::TestQueue2 + 1 + q, pool));
+    }
+    
+    for (uint32_t j=0; j<jobsPerQueue; j++)
+    {
+        for (uint32_t q=0; q<numQueues; q++)
+        {
+            queues[q]->enqueue([&, q, j]() {
+                if (running[q]++ != 0)
+                    overlaps++;
+                ran[q].push_back(j);
+                running[q]--;
+                done++;
+            });
+        }
+    }
+    
+    while (done < static_cast<int>(numQueues*jobsPerQueue))
+        std::this_thread::yield();
+    
+    REQUIRE(overlaps == 0);
+    for (uint32_t q=0; q<numQueues; q++)
+    {
+        REQUIRE(ran[q].size() == jobsPerQueue);
+        REQUIRE(std::is_sorted(ran[q].begin(), ran[q].end()));
+    }
+    
+    // registered serial queues work with tasks like any other queue
+    Async::registerQueue(queues[0]);
+    Async::Task<int> t = Async::CreateTask(queues[0]->getId(), []() { return 2; });
+    REQUIRE(t.then([](int x) { return x*x; }).get() == 4);
+    REQUIRE(Async::unregisterQueue(queues[0]->getId()));
+    
+    // a full target that refuses the drain job gets another one once it has room
+    Async::Queue::Options options;
+    options.maxJobs = 1;
+    options.overflow = Async::Queue::Overflow::Fail;
+    Async::Queue::Ptr full = std::make_shared<Async::Queue>(Test::TestQueue1 + 36, options);
+    Async::SerialQueue::Ptr serial = std::make_shared<Async::SerialQueue>(full);
+    REQUIRE(full->enqueue([]() {}) != 0);
+    int serialRuns = 0;
+    REQUIRE(serial->enqueue([&serialRuns]() { serialRuns++; }) != 0);
+    REQUIRE(full->runNext());
+    while (full->runNext()) {}
+    REQUIRE(serialRuns == 1);
+    
+    // and a dropped drain job is replaced by the next enqueue
+    REQUIRE(serial->enqueue([&serialRuns]() { serialRuns++; }) != 0);
+    REQUIRE(full->clear() == 1);
+    REQUIRE(serial->enqueue([&serialRuns]() { serialRuns++; }) != 0);
+    while (full->runNext()) {}
+    REQUIRE(serialRuns == 3);
+}
+
+TEST_CASE("spinning idle workers", "[IdlePolicy]")
+{
+    Async::ThreadPoolQueue::Options options;
+    options.spinCount = 200;
+    options.yieldCount = 4;
+    Async::ThreadPoolQueue queue(Test::TestQueue1 + 10, Test::NumThreads, options);
+    
+    // jobs trickling in while workers spin, then after they have parked again
+    std::atomic_int count(0);
+    for (int round=0; round<2; round++)
+    {
+        for (int i=0; i<100; i++)
+        {
+            queue.enqueue([&count]() { count++; });
+            if (i % 10 == 0)
+                std::this_thread::yield();
+        }
+        while (count < 100*(round + 1))
+            std::this_thread::yield();
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    REQUIRE(count == 200);
+}
+
+TEST_CASE("elastic thread pool", "[ElasticPool]")
+{
+    Async::ThreadPoolQueue::Options options;
+    options.maxThreads = 4;
+    options.spawnQueueDepth = 4;
+    options.keepAlive = std::chrono::milliseconds(50);
+    Async::ThreadPoolQueue queue(Test::TestQueue1 + 11, 1, options);
+    REQUIRE(queue.getNumThreads() == 1);
+    
+    // a backlog of slow jobs grows the pool, but never past maxThreads
+    std::atomic_int running(0);
+    std::atomic_int peak(0);
+    std::atomic_int done(0);
+    for (int i=0; i<40; i++)
+    {
+        queue.enqueue([&]() {
+            int now = ++running;
+            int seen = peak;
+            while (now > seen && !peak.compare_exchange_weak(seen, now)) {}
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            running--;
+            done++;
+        });
+    }
+    while (done < 40)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    
+    REQUIRE(queue.getNumSpawned() > 0);
+    REQUIRE(peak > 1);
+    REQUIRE(peak <= 4);
+    
+    // idle workers past the keep-alive retire down to the minimum
+    for (int i=0; i<200 && queue.getNumThreads() > 1; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    REQUIRE(queue.getNumThreads() == 1);
+    REQUIRE(queue.getNumRetired() == queue.getNumSpawned());
+    
+    // and the survivor still takes work
+    queue.enqueue([&done]() { done++; });
+    while (done < 41)
+        std::this_thread::yield();
+    
+    // work stealing pools ignore maxThreads and keep their workers
+    options.workStealing = true;
+    Async::ThreadPoolQueue stealing(Test::TestQueue1 + 37, 1, options);
+    for (int i=0; i<40; i++)
+    {
+        stealing.enqueue([&done]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            done++;
+        });
+    }
+    while (done < 81)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    REQUIRE(stealing.getNumSpawned() == 0);
+    REQUIRE(stealing.getNumThreads() == 1);
+}
+
+TEST_CASE("worker placement", "[Placement]")
+{
+    REQUIRE(Async::Details::parseCpuList("0-3,8,10-11\n") == Async::CpuSet({0, 1, 2, 3, 8, 10, 11}));
+    REQUIRE(Async::Details::parseCpuList("5") == Async::CpuSet({5}));
+    REQUIRE(Async::Details::parseCpuList("") == Async::CpuSet());
+    
+    Async::CpuSet available = Async::getAvailableCpus();
+    REQUIRE(!available.empty());
+    REQUIRE(Async::getNumNumaNodes() >= 1);
+    
+    // workers pinned one per core still run everything
+    Async::ThreadPoolQueue::Options options;
+    options.placement = Async::ThreadPoolQueue::Placement::Cores;
+    std::atomic_int count(0);
+    {
+        Async::ThreadPoolQueue queue(Test::TestQueue1 + 12, Test::NumThreads, options);
+        for (int i=0; i<100; i++)
+            queue.enqueue([&count]() { count++; });
+        while (count < 100)
+            std::this_thread::yield();
+    }
+    
+    // one registered pool per node, addressed by queue id
+    const uint32_t firstNodeQueue = Test::TestQueue1 + 100;
+    auto nodeQueues = Async::createNumaQueues(firstNodeQueue, 1);
+    REQUIRE(nodeQueues.size() == Async::getNumNumaNodes());
+    for (uint32_t node=0; node<nodeQueues.size(); node++)
+    {
+        REQUIRE(Async::CreateTask(firstNodeQueue + node, [node]() { return node; }).get() == node);
+        REQUIRE(Async::unregisterQueue(firstNodeQueue + node));
+    }
+}
+
+TEST_CASE("queue registry", "[Registry]")
+{
+    const uint32_t firstQueue = Test::TestQueue1 + 200;
+    const uint32_t numQueues = 16;
+    
+    // lookups racing with registrations and unregistrations
+    std::atomic<bool> done(false);
+    std::atomic_int found(0);
+    std::vector<std::thread> readers;
+    for (int i=0; i<2; i++)
+    {
+        readers.emplace_back([&]() {
+            while (!done)
+            {
+                for (uint32_t q=0; q<numQueues; q++)
+                {
+                    if (Async::getQueue(firstQueue + q))
+                        found++;
+                    Async::enqueue(firstQueue + q, []() {});
+                }
+            }
+        });
+    }
+    
+    for (int round=0; round<50; round++)
+    {
+        for (uint32_t q=0; q<numQueues; q++)
+            Async::registerQueue(std::make_shared<Async::Queue>(firstQueue + q));
+        for (uint32_t q=0; q<numQueues; q++)
+            REQUIRE(Async::unregisterQueue(firstQueue + q));
+    }
+    done = true;
+    for (auto& reader : readers)
+        reader.join();
+    
+    REQUIRE(!Async::getQueue(firstQueue));
+    REQUIRE(!Async::unregisterQueue(firstQueue));
+    
+    // the registry releases unregistered queues
+    Async::Queue::WeakPtr weak;
+    {
+        Async::Queue::Ptr q = std::make_shared<Async::Queue>(firstQueue);
+        weak = q;
+        Async::registerQueue(q);
+        Async::registerQueue(std::make_shared<Async::Queue>(firstQueue)); // duplicate id, ignored
+        REQUIRE(Async::getQueue(firstQueue) == q);
+    }
+    REQUIRE(Async::enqueue(firstQueue, []() {}) != 0);
+    REQUIRE(Async::unregisterQueue(firstQueue));
+    
+    // once no reader can still see the old table, the next registry access frees it
+    for (int i=0; i<1000 && !weak.expired(); i++)
+    {
+        Async::getQueue(firstQueue);
+        std::this_thread::yield();
+    }
+    REQUIRE(weak.expired());
+}
+
+TEST_CASE("direct queue handles", "[QueueRef]")
+{
+    const uint32_t poolId = Test::TestQueue1 + 13;
+    Async::QueueRef pool = Async::registerQueue(std::make_shared<Async::ThreadPoolQueue>(poolId, Test::NumThreads));
+    REQUIRE(pool.isDirect());
+    REQUIRE(pool.getId() == poolId);
+    REQUIRE(!Async::registerQueue(std::make_shared<Async::Queue>(poolId)));
+    
+    // tasks and continuations created from a handle keep using it
+    Async::Task<int> t = Async::CreateTask(pool, []() { return 3; });
+    Async::Task<int> next = t.then([](int x) { return x*2; });
+    REQUIRE(next.getQueue().isDirect());
+    REQUIRE(next.get() == 6);
+    REQUIRE(next.getQueueId() == poolId);
+    
+    auto tasks = Async::CreateTasks(pool, 10, [](size_t i) { return static_cast<int>(i); });
+    REQUIRE(Async::WhenAll(pool, tasks.begin(), tasks.end()).get().size() == 10);
+    REQUIRE(Async::WhenAny(pool, tasks.begin(), tasks.end()).get().size() >= 1);
+    
+    // handles and ids can be mixed, and cancel goes straight to the queue
+    const uint32_t manualId = Test::TestQueue1 + 14;
+    Async::Queue::Ptr manual = std::make_shared<Async::Queue>(manualId);
+    Async::QueueRef manualRef = Async::registerQueue(manual);
+    Async::Task<int> pending = Async::CreateTask(manualRef, []() { return 1; });
+    Async::Task<int> byId = Async::CreateTask(manualId, []() { return 2; });
+    REQUIRE(!byId.getQueue().isDirect());
+    REQUIRE(pending.cancel());
+    REQUIRE(pending.isCanceled());
+    REQUIRE(manual->runNext());
+    REQUIRE(byId.get() == 2);
+    REQUIRE(!manual->runNext());
+    
+    REQUIRE(Async::unregisterQueue(manualId));
+    REQUIRE(Async::unregisterQueue(poolId));
+}
+
+namespace Test
+{
+    // fork/join sum of [first, last), every level waits on its two halves
+    int forkJoinSum(uint32_t queueId, int first, int last)
+    {
+        if (last - first <= 4)
+        {
+            int sum = 0;
+            for (int i=first; i<last; i++)
+                sum += i;
+            return sum;
+        }
+        
+        int mid = (first + last) / 2;
+        auto left = Async::CreateTask(queueId, [=]() { return forkJoinSum(queueId, first, mid); });
+        auto right = Async::CreateTask(queueId, [=]() { return forkJoinSum(queueId, mid, last); });
+        return left.get() + right.get();
+    }
+}
+
+TEST_CASE("help while waiting", "[HelpWhileWaiting]")
+{
+    // far more nested waits than threads, which would deadlock without helping
+    const uint32_t queueId = Test::TestQueue1 + 15;
+    Async::registerQueue(std::make_shared<Async::ThreadPoolQueue>(queueId, 2));
+    REQUIRE(!Async::ThreadPoolQueue::isWorkerThread());
+    
+    std::atomic<bool> onWorker(false);
+    auto root = Async::CreateTask(queueId, [queueId, &onWorker]() {
+        onWorker = Async::ThreadPoolQueue::isWorkerThread();
+        return Test::forkJoinSum(queueId, 0, 1024);
+    });
+    REQUIRE(root.get() == 1023*1024/2);
+    REQUIRE(onWorker);
+    REQUIRE(Async::unregisterQueue(queueId));
+}
+
+TEST_CASE("pool drain and shutdown", "[Shutdown]")
+{
+    typedef std::chrono::milliseconds ms;
+    
+    // drain finishes queued work, including jobs enqueued by that work
+    std::atomic_int ran(0);
+    {
+        Async::ThreadPoolQueue pool(Test::TestQueue1 + 16, 2);
+        for (int i=0; i<20; i++)
+        {
+            pool.enqueue([&ran, &pool]() {
+                std::this_thread::sleep_for(ms(1));
+                pool.enqueue([&ran]() { ran++; });
+                ran++;
+            });
+        }
+        auto report = pool.drain(std::chrono::steady_clock::now() + std::chrono::seconds(10));
+        REQUIRE(report.numLeft == 0);
+        REQUIRE(ran == 40);
+        REQUIRE(report.drainTime > std::chrono::steady_clock::duration::zero());
+    }
+    
+    // past the deadline the rest is dropped, and tasks that never ran are canceled
+    {
+        const uint32_t queueId = Test::TestQueue1 + 17;
+        Async::ThreadPoolQueue::Ptr pool = std::make_shared<Async::ThreadPoolQueue>(queueId, 1);
+        Async::QueueRef ref = Async::registerQueue(pool);
+        std::vector<Async::Task<int>> tasks;
+        for (int i=0; i<50; i++)
+            tasks.push_back(Async::CreateTask(ref, [i]() { std::this_thread::sleep_for(ms(2)); return i; }));
+        Async::Task<int> continuation = tasks.back().then([](int x) { return x; });
+        
+        auto report = pool->drain(std::chrono::steady_clock::now() + ms(20));
+        REQUIRE(report.numLeft > 0);
+        
+        size_t completed = 0;
+        size_t canceled = 0;
+        for (auto& task : tasks)
+        {
+            try
+            {
+                task.get();
+                completed++;
+            }
+            catch (const std::future_error&)
+            {
+                REQUIRE(task.isCanceled());
+                canceled++;
+            }
+        }
+        REQUIRE(completed + canceled == tasks.size());
+        REQUIRE(canceled == report.numLeft);
+        REQUIRE_THROWS_AS(continuation.get(), const std::future_error&);
+        REQUIRE(Async::unregisterQueue(queueId));
+    }
+    
+    // shutdownNow drops everything queued and waits only for the running job
+    {
+        Async::ThreadPoolQueue pool(Test::TestQueue1 + 18, 1);
+        std::atomic<bool> started(false);
+        pool.enqueue([&started]() {
+            started = true;
+            std::this_thread::sleep_for(ms(20));
+        });
+        while (!started)
+            std::this_thread::yield();
+        
+        for (int i=0; i<10; i++)
+            pool.enqueue([&ran]() { ran++; });
+        
+        auto report = pool.shutdownNow();
+        REQUIRE(report.numLeft == 10);
+        REQUIRE(report.joinTime > std::chrono::steady_clock::duration::zero());
+        REQUIRE(ran == 40);
+        REQUIRE(pool.empty());
+    }
+}
+
+TEST_CASE("bounded queues", "[BoundedQueues]")
+{
+    typedef std::chrono::milliseconds ms;
+    
+    std::string ran;
+    auto job = [&ran](char c) {
+        return [&ran, c]() { ran.push_back(c); };
+    };
+    
+    Async::Queue::Options options;
+    options.maxJobs = 2;
+    
+    // fail fast, through the policy or tryEnqueue
+    options.overflow = Async::Queue::Overflow::Fail;
+    Async::Queue failing(Test::TestQueue1 + 19, options);
+    REQUIRE(failing.getMaxJobs() == 2);
+    REQUIRE(failing.enqueue(job('a')) != 0);
+    REQUIRE(failing.tryEnqueue(job('b')) != 0);
+    REQUIRE(failing.full());
+    REQUIRE(failing.enqueue(job('x')) == 0);
+    REQUIRE(failing.tryEnqueue(job('x')) == 0);
+    while (failing.runNext()) {}
+    REQUIRE(ran == "ab");
+    
+    // the oldest job of the lowest band goes first
+    options.overflow = Async::Queue::Overflow::DropOldest;
+    options.numPriorities = 2;
+    Async::Queue dropping(Test::TestQueue1 + 20, options);
+    ran.clear();
+    dropping.enqueue(job('a'), 0);
+    dropping.enqueue(job('x'), 1);
+    dropping.enqueue(job('b'), 0);
+    dropping.enqueue(job('c'), 1);
+    while (dropping.runNext()) {}
+    REQUIRE(ran == "bc");
+    
+    // overflow runs right away on the producer
+    options.overflow = Async::Queue::Overflow::RunOnCaller;
+    options.numPriorities = 1;
+    Async::Queue running(Test::TestQueue1 + 21, options);
+    ran.clear();
+    std::vector<std::function<void()>> batch = { job('c'), job('d') };
+    running.enqueue(job('a'));
+    running.enqueue(job('b'));
+    REQUIRE(running.enqueue(job('r')) == 0);
+    REQUIRE(running.enqueueBulk(batch.begin(), batch.end()) == 0);
+    REQUIRE(ran == "rcd");
+    running.clear();
+    
+    // a ring buffer is bounded by its capacity
+    Async::Queue::Options ringOptions;
+    ringOptions.storage = Async::Queue::Storage::RingBuffer;
+    ringOptions.capacity = 2;
+    ringOptions.overflow = Async::Queue::Overflow::Fail;
+    Async::Queue ring(Test::TestQueue1 + 22, ringOptions);
+    ran.clear();
+    REQUIRE(ring.enqueue(job('a')) != 0);
+    REQUIRE(ring.enqueue(job('b')) != 0);
+    REQUIRE(ring.enqueue(job('x')) == 0);
+    while (ring.runNext()) {}
+    REQUIRE(ran == "ab");
+    
+    // a blocked producer resumes once a consumer makes room
+    options.overflow = Async::Queue::Overflow::Block;
+    Async::Queue blocking(Test::TestQueue1 + 23, options);
+    std::atomic_int count(0);
+    auto counter = [&count]() { count++; };
+    blocking.enqueue(counter);
+    blocking.enqueue(counter);
+    std::atomic<bool> enqueued(false);
+    std::thread producer([&blocking, &enqueued, &counter]() {
+        blocking.enqueue(counter);
+        enqueued = true;
+    });
+    std::this_thread::sleep_for(ms(10));
+    REQUIRE(!enqueued);
+    REQUIRE(blocking.runNext());
+    producer.join();
+    REQUIRE(enqueued);
+    while (blocking.runNext()) {}
+    REQUIRE(count == 3);
+    
+    // a task based producer continues once there is room instead of blocking
+    blocking.enqueue(counter);
+    blocking.enqueue(counter);
+    std::atomic<bool> resumed(false);
+    Async::Task<int> next = Async::WhenSpaceAvailable(blocking, Test::TestQueue1, [&resumed]() {
+        resumed = true;
+        return 1;
+    });
+    std::this_thread::sleep_for(ms(10));
+    REQUIRE(!resumed);
+    REQUIRE(blocking.runNext());
+    REQUIRE(next.get() == 1);
+    REQUIRE(resumed);
+    
+    bool notified = false;
+    blocking.notifyWhenSpaceAvailable([&notified]() { notified = true; });
+    REQUIRE(notified);
+    blocking.clear();
+}
+
+TEST_CASE("queue statistics", "[Stats]")
+{
+    typedef std::chrono::milliseconds ms;
+    
+    REQUIRE(Async::LatencyHistogram::bucketFor(std::chrono::nanoseconds(500)) == 0);
+    REQUIRE(Async::LatencyHistogram::bucketFor(std::chrono::microseconds(1)) == 1);
+    REQUIRE(Async::LatencyHistogram::bucketFor(std::chrono::microseconds(3)) == 2);
+    REQUIRE(Async::LatencyHistogram::bucketFor(std::chrono::hours(24)) == Async::LatencyHistogram::NumBuckets - 1);
+    
+    Async::Queue::Options options;
+    options.maxJobs = 3;
+    options.overflow = Async::Queue::Overflow::Fail;
+    options.timeJobs = true;
+    Async::Queue queue(Test::TestQueue1 + 24, options);
+    
+    auto sleeper = []() { std::this_thread::sleep_for(ms(2)); };
+    queue.enqueue(sleeper);
+    uint64_t canceled = queue.enqueue(sleeper);
+    queue.enqueue(sleeper);
+    REQUIRE(queue.enqueue(sleeper) == 0);
+    REQUIRE(queue.cancel(canceled));
+    while (queue.runNext()) {}
+    queue.enqueue(sleeper);
+    REQUIRE(queue.clear() == 1);
+    
+    Async::QueueStats stats = queue.stats();
+    REQUIRE(stats.queueId == Test::TestQueue1 + 24);
+    REQUIRE(stats.numEnqueued == 4);
+    REQUIRE(stats.numDequeued == 2);
+    REQUIRE(stats.numCanceled == 1);
+    REQUIRE(stats.numRejected == 1);
+    REQUIRE(stats.numDropped == 1);
+    REQUIRE(stats.depth == 0);
+    REQUIRE(stats.peakDepth == 3);
+    REQUIRE(stats.waitTime.count() == 2);
+    REQUIRE(stats.runTime.count() == 2);
+    REQUIRE(stats.runTime.percentile(0.5) >= ms(2));
+    REQUIRE(stats.workers.empty());
+    
+    // short-lived threads hand their counter blocks on without losing counts
+    for (int i=0; i<64; i++)
+    {
+        std::thread([&queue]() {
+            queue.enqueue([]() {});
+            queue.runNext();
+        }).join();
+    }
+    stats = queue.stats();
+    REQUIRE(stats.numEnqueued == 68);
+    REQUIRE(stats.numDequeued == 66);
+    
+    // pools report their workers, and registered queues show up in the registry snapshot
+    const uint32_t poolId = Test::TestQueue1 + 25;
+    Async::ThreadPoolQueue::Ptr pool = std::make_shared<Async::ThreadPoolQueue>(poolId, 2);
+    Async::QueueRef ref = Async::registerQueue(pool);
+    Async::Task<int> task = Async::CreateTask(ref, []() { return 1; });
+    REQUIRE(task.get() == 1);
+    
+    stats = pool->stats();
+    REQUIRE(stats.workers.size() == 2);
+    for (auto& worker : stats.workers)
+        REQUIRE(worker.busyTime + worker.idleTime > std::chrono::steady_clock::duration::zero());
+    
+    std::vector<Async::QueueStats> all = Async::allQueueStats();
+    auto it = std::find_if(all.begin(), all.end(), [poolId](const Async::QueueStats& s) {
+        return s.queueId == poolId;
+    });
+    REQUIRE(it != all.end());
+    REQUIRE(it->numEnqueued == 1);
+    REQUIRE(it->numDequeued == 1);
+    for (size_t i=1; i<all.size(); i++)
+        REQUIRE(all[i - 1].queueId < all[i].queueId);
+    REQUIRE(Async::unregisterQueue(poolId));
+}
+
+TEST_CASE("execution tracing", "[Trace]")
+{
+    // a continuation chain shows up as job slices, queue waits and flow arrows
+    Async::startTracing();
+    Async::Task<int> chain = Async::CreateTask(Test::TestQueue1, []() {
+        return 1;
+    }).then(Test::TestQueue2, [](int x) {
+        return x + 1;
+    });
+    REQUIRE(chain.get() == 2);
+    Async::stopTracing();
+    
+    std::ostringstream trace;
+    Async::writeChromeTrace(trace);
+    std::string json = trace.str();
+    REQUIRE(json.find("\"traceEvents\"") != std::string::npos);
+    REQUIRE(json.find("\"name\":\"queue 444\",\"cat\":\"job\",\"ph\":\"X\"") != std::string::npos);
+    
+    // the last job may still be finishing after get() returns
+    REQUIRE(json.find("\"name\":\"queue 999\",\"cat\":\"job\"") != std::string::npos);
+    REQUIRE(json.find("\"cat\":\"wait\",\"ph\":\"b\"") != std::string::npos);
+    REQUIRE(json.find("\"ph\":\"s\"") != std::string::npos);
+    REQUIRE(json.find("\"ph\":\"f\"") != std::string::npos);
+    REQUIRE(json.find("\"lostEvents\":0}") != std::string::npos);
+    
+    // full buffers drop events instead of growing
+    Async::Queue queue(Test::TestQueue1 + 26);
+    Async::startTracing(4);
+    for (int i=0; i<10; i++)
+        queue.enqueue([]() {});
+    while (queue.runNext()) {}
+    Async::stopTracing();
+    
+    trace.str("");
+    Async::writeChromeTrace(trace);
+    REQUIRE(trace.str().find("\"lostEvents\":26}") != std::string::npos);
+    
+    // short-lived threads share buffers, events of threads that exited are kept
+    Async::startTracing();
+    for (int i=0; i<32; i++)
+    {
+        std::thread([&queue]() {
+            queue.enqueue([]() {});
+            queue.runNext();
+        }).join();
+    }
+    Async::stopTracing();
+    
+    trace.str("");
+    Async::writeChromeTrace(trace);
+    json = trace.str();
+    auto count = [&json](const std::string& needle) {
+        size_t n = 0;
+        for (size_t pos = json.find(needle); pos != std::string::npos; pos = json.find(needle, pos + 1))
+            n++;
+        return n;
+    };
+    size_t numJobs = count("\"name\":\"queue " + std::to_string(Test::TestQueue1 + 26) + "\",\"cat\":\"job\",\"ph\":\"X\"");
+    size_t numThreads = count("\"thread_name\"");
+    REQUIRE(numJobs == 32);
+    REQUIRE(numThreads < 32);
+}
+
+TEST_CASE("run loop queues", "[RunLoop]")
+{
+    const uint32_t mainId = Test::TestQueue1 + 28;
+    Async::RunLoopQueue::Ptr runLoop = std::make_shared<Async::RunLoopQueue>(mainId);
+    Async::registerQueue(runLoop);
+    
+    // results computed on the pool are marshaled back to the pumping thread
+    std::thread::id mainThread = std::this_thread::get_id();
+    std::atomic_bool onMain(false);
+    std::atomic_bool done(false);
+    Async::Task<int> t = Async::CreateTask(Test::TestQueue1, []() {
+        return 6;
+    }).then(mainId, [&](int x) {
+        onMain = std::this_thread::get_id() == mainThread;
+        done = true;
+        return x*7;
+    });
+    REQUIRE(runLoop->runUntil([&]() { return done.load(); }) == 1);
+    REQUIRE(onMain);
+    REQUIRE(t.get() == 42);
+    
+    // an idle run loop parks until the deadline
+    auto start = std::chrono::steady_clock::now();
+    REQUIRE(runLoop->runFor(std::chrono::milliseconds(20)) == 0);
+    REQUIRE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(20));
+    
+    // jobs enqueued while draining wait for the next call
+    int count = 0;
+    std::function<void()> requeue = [&]() {
+        count++;
+        runLoop->enqueue(requeue);
+    };
+    for (int i=0; i<3; i++)
+        runLoop->enqueue(requeue);
+    REQUIRE(runLoop->runAllPending() == 3);
+    REQUIRE(count == 3);
+    REQUIRE(runLoop->runAllPending() == 3);
+    REQUIRE(count == 6);
+    runLoop->clear();
+    
+    // wakeUp() makes a parked owner re-check a condition no job changes
+    std::atomic_bool stop(false);
+    std::thread waker([&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        stop = true;
+        runLoop->wakeUp();
+    });
+    REQUIRE(runLoop->runUntil([&]() { return stop.load(); }) == 0);
+    waker.join();
+    
+    REQUIRE(Async::unregisterQueue(mainId));
+}
+
+TEST_CASE("I/O readiness", "[Reactor]")
+{
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+    
+    // the read completes on the pool once the other end has written
+    Async::Task<char> received = Async::whenReadable(fds[0], Test::TestQueue1).then([&]() {
+        char c = 0;
+        return (read(fds[0], &c, 1) == 1) ? c : '\0';
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    REQUIRE(Async::whenWritable(fds[1], Test::TestQueue2).then([&]() {
+        return write(fds[1], "x", 1);
+    }).get() == 1);
+    REQUIRE(received.get() == 'x');
+    
+    // canceled watches never fire
+    Async::Reactor reactor;
+    std::atomic_bool fired(false);
+    uint64_t watchId = reactor.watch(fds[0], Async::Reactor::Readable, [&]() { fired = true; });
+    REQUIRE(watchId != 0);
+    REQUIRE(reactor.numWatches() == 1);
+    REQUIRE(reactor.cancel(watchId));
+    REQUIRE_FALSE(reactor.cancel(watchId));
+    REQUIRE(write(fds[1], "y", 1) == 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    REQUIRE_FALSE(fired);
+    REQUIRE(reactor.numWatches() == 0);
+    
+    // canceling a waiting task drops its watch
+    int other[2];
+    REQUIRE(pipe(other) == 0);
+    Async::Task<void> waiting = Async::Task<void>::whenReady(reactor, other[0], Async::Reactor::Readable, Test::TestQueue1, []() {});
+    REQUIRE(reactor.numWatches() == 1);
+    REQUIRE(waiting.cancel());
+    REQUIRE(reactor.numWatches() == 0);
+    
+    // a watch left on a closed descriptor doesn't keep a reused one from being watched
+    Async::Task<void> stale = Async::Task<void>::whenReady(reactor, other[0], Async::Reactor::Readable, Test::TestQueue1, []() {});
+    int reused = other[0];
+    close(other[0]);
+    close(other[1]);
+    REQUIRE(pipe(other) == 0);
+    REQUIRE(other[0] == reused);
+    REQUIRE(write(other[1], "z", 1) == 1);
+    Async::Task<void>::whenReady(reactor, other[0], Async::Reactor::Readable, Test::TestQueue1, []() {}).wait();
+    stale.cancel();
+    close(other[0]);
+    close(other[1]);
+    
+    // a hang-up completes a pending read, which then sees the end of the stream
+    Async::Task<ssize_t> eof = Async::whenReadable(fds[0], Test::TestQueue1).then([&]() {
+        char buffer[4];
+        read(fds[0], buffer, sizeof(buffer));
+        return read(fds[0], buffer, sizeof(buffer));
+    });
+    close(fds[1]);
+    REQUIRE(eof.get() == 0);
+    close(fds[0]);
+}
+
+TEST_CASE("file I/O", "[FileIO]")
+{
+    char path[] = "/tmp/AsyncFileIOXXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    unlink(path);
+    
+    const std::string text = "hello, file";
+    REQUIRE(Async::writeFile(Test::TestQueue1, fd, 0, text.data(), text.size()).get() == text.size());
+    
+    // one read per byte, all in flight at once
+    std::string readBack(text.size(), ' ');
+    std::vector<Async::Task<size_t>> reads;
+    for (size_t i=0; i<text.size(); i++)
+        reads.push_back(Async::readFile(Test::TestQueue1, fd, i, &readBack[i], 1));
+    for (auto& read : reads)
+        REQUIRE(read.get() == 1);
+    REQUIRE(readBack == text);
+    
+    // continuations run on the queue given to then()
+    char c = 0;
+    Async::Task<bool> atEnd = Async::readFile(Test::TestQueue1, fd, text.size(), &c, 1).then(Test::TestQueue2, [](size_t n) {
+        return n == 0;
+    });
+    REQUIRE(atEnd.get());
+    
+    size_t failed = Async::readFile(Test::TestQueue1, -1, 0, &c, 1).get();
+    REQUIRE(Async::isIOError(failed));
+    REQUIRE(Async::ioErrorCode(failed) == EBADF);
+    
+    // the thread pool fallback behaves the same
+    Async::FileIO::Options options;
+    options.backend = Async::FileIO::Backend::Threads;
+    Async::FileIO threads(options);
+    REQUIRE(threads.getBackend() == Async::FileIO::Backend::Threads);
+    char buffer[5] = {};
+    std::promise<size_t> done;
+    threads.read(fd, 7, buffer, sizeof(buffer), [&](size_t n) { done.set_value(n); });
+    REQUIRE(done.get_future().get() == 4);
+    REQUIRE(std::string(buffer, 4) == "file");
+    
+    close(fd);
+}
+
+#ifdef ASYNC_COROUTINES
+TEST_CASE("coroutines", "[Coroutines]")
+{
+    auto addOne = [](Async::Task<int> input) -> Async::Task<int> {
+        co_return (co_await input) + 1;
+    };
+    REQUIRE(addOne(Async::CreateTask(Test::TestQueue1, []() { return 41; })).get() == 42);
+    
+    // a long pipeline without a continuation task per step
+    auto sum = [](uint32_t count) -> Async::Task<int> {
+        int total = 0;
+        for (uint32_t i=0; i<count; i++)
+            total += co_await Async::CreateTask(Test::TestQueue1, [i]() { return static_cast<int>(i); });
+        co_return total;
+    };
+    REQUIRE(sum(100).get() == 4950);
+    REQUIRE(sum(10).then(Test::TestQueue2, [](int x) { return x*2; }).get() == 90);
+    
+    // hopping back onto a thread the caller pumps
+    const uint32_t mainId = Test::TestQueue1 + 29;
+    Async::RunLoopQueue::Ptr runLoop = std::make_shared<Async::RunLoopQueue>(mainId);
+    Async::registerQueue(runLoop);
+    auto resumeOnMain = [](Async::QueueRef queue) -> Async::Task<std::thread::id> {
+        co_await Async::CreateTask(Test::TestQueue1, []() { return 0; });
+        co_await Async::resumeOn(queue);
+        co_return std::this_thread::get_id();
+    };
+    Async::Task<std::thread::id> onMain = resumeOnMain(mainId);
+    runLoop->runUntil([&]() { return onMain.getFuture().wait_for(std::chrono::seconds(0)) == std::future_status::ready; });
+    REQUIRE(onMain.get() == std::this_thread::get_id());
+    REQUIRE(Async::unregisterQueue(mainId));
+    
+    // a full queue that runs the resume job on the caller resumes the coroutine once
+    const uint32_t fullId = Test::TestQueue1 + 34;
+    Async::Queue::Options options;
+    options.maxJobs = 1;
+    options.overflow = Async::Queue::Overflow::RunOnCaller;
+    Async::Queue::Ptr full = std::make_shared<Async::Queue>(fullId, options);
+    Async::registerQueue(full);
+    full->enqueue([]() {});
+    auto resumeOnFull = [](Async::QueueRef queue, int* runs) -> Async::Task<int> {
+        co_await Async::resumeOn(queue);
+        co_return ++*runs;
+    };
+    int runs = 0;
+    REQUIRE(resumeOnFull(fullId, &runs).get() == 1);
+    REQUIRE(runs == 1);
+    
+    // one that rejects the job keeps the coroutine running on the current thread
+    Async::unregisterQueue(fullId);
+    options.overflow = Async::Queue::Overflow::Fail;
+    full = std::make_shared<Async::Queue>(fullId, options);
+    Async::registerQueue(full);
+    full->enqueue([]() {});
+    REQUIRE(resumeOnFull(fullId, &runs).get() == 2);
+    REQUIRE(Async::unregisterQueue(fullId));
+    
+    // exceptions escaping the coroutine surface in get()
+    auto fail = []() -> Async::Task<void> {
+        co_await Async::CreateTask(Test::TestQueue1, []() {});
+        throw std::runtime_error("failed");
+    };
+    REQUIRE_THROWS_AS(fail().get(), const std::runtime_error&);
+}
+#endif
+
+#ifdef ASYNC_OBSERVER
+TEST_CASE("instrumentation hooks", "[Hooks]")
+{
+    uint64_t enqueued = Test::numEnqueued;
+    uint64_t dequeued = Test::numDequeued;
+    uint64_t started = Test::numStarted;
+    uint64_t finished = Test::numFinished;
+    uint64_t canceled = Test::numCanceled;
+    
+    Async::Queue queue(Test::TestQueue1 + 27);
+    queue.enqueue([]() {});
+    uint64_t jobId = queue.enqueue([]() {});
+    REQUIRE(queue.cancel(jobId));
+    while (queue.runNext()) {}
+    
+    REQUIRE(Test::numEnqueued - enqueued == 2);
+    REQUIRE(Test::numDequeued - dequeued == 1);
+    REQUIRE(Test::numStarted - started == 1);
+    REQUIRE(Test::numFinished - finished == 1);
+    REQUIRE(Test::numCanceled - canceled == 1);
+    
+    uint64_t tasksCompleted = Test::numTasksCompleted;
+    REQUIRE(Async::CreateTask(Test::TestQueue1, []() { return 1; }).get() == 1);
+    while (Test::numTasksCompleted == tasksCompleted)
+        std::this_thread::yield();
+}
+#endif
+
 int main(int argc, char* const argv[])
 {
     setupQueues();